@@ -0,0 +1,72 @@
+#include "vm.hpp"
+#include "parser.h"
+
+#include <chrono>
+
+#include <fmt/format.h>
+
+/* per-call overhead: recursive fib, and a loop calling a two-argument function */
+
+/* compile() hands every function it finishes to dump(), main.cpp prints them */
+void dump(FuncState&) {}
+
+static const char* source = R"(
+	fn fib(n: int): int {
+		if (n < 2) {
+			return n
+		}
+		return fib(n - 1) + fib(n - 2)
+	}
+
+	fn add(a: int, b: int): int {
+		return a + b
+	}
+
+	fn calls(n: int): int {
+		let mut i = 0
+		let mut s = 0
+		while (i < n) {
+			s = add(s, i)
+			i += 1
+		}
+		return s
+	}
+)";
+
+/* the best of five runs of 'fn', in nanoseconds */
+static double best_of(VM& vm, const Function& fn, Value arg, int64_t expected) {
+	double best = 1e300;
+	for (int i = 0; i < 5; i++) {
+		auto t0 = std::chrono::steady_clock::now();
+		auto result = vm.call(fn, {&arg, 1});
+		auto t1 = std::chrono::steady_clock::now();
+		if (result.i64 != expected) {
+			fmt::print("{} returned {}, expected {}\n", fn.name, result.i64, expected);
+			exit(1);
+		}
+		best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count());
+	}
+	return best;
+}
+
+int main(int argc, char** argv) {
+	int64_t depth = argc > 1 ? atoll(argv[1]) : 30;
+	int64_t n = argc > 2 ? atoll(argv[2]) : 10000000;
+
+	Environment env{};
+	auto module = compile(env, source);
+	VM vm;
+
+	/* fib(depth) and how many calls computing it takes */
+	int64_t fib = 0, next = 1, calls = 1, next_calls = 1;
+	for (int64_t i = 0; i < depth; i++) {
+		fib = std::exchange(next, fib + next);
+		calls = std::exchange(next_calls, calls + next_calls + 1);
+	}
+	auto ns = best_of(vm, *module.function("fib"), {.i64 = depth}, fib);
+	fmt::print("fib({}): {} calls, {:.2f} ms, {:.2f} ns/call\n", depth, calls, ns / 1e6, ns / double(calls));
+
+	ns = best_of(vm, *module.function("calls"), {.i64 = n}, n * (n - 1) / 2);
+	fmt::print("calls({}): {:.2f} ms, {:.2f} ns/iteration\n", n, ns / 1e6, ns / double(n));
+	return 0;
+}
@@ -0,0 +1,64 @@
+#include "vm.hpp"
+#include "parser.h"
+
+#include <chrono>
+
+#include <fmt/format.h>
+
+/*
+ * Dispatch cost per instruction: the expression main.cpp compiles, run in a
+ * countdown loop. Build once with L_COMPUTED_GOTO and once without to compare
+ * threaded dispatch with the switch.
+ */
+
+/* compile() hands every function it finishes to dump(), main.cpp prints them */
+void dump(FuncState&) {}
+
+static const char* source = R"(
+	fn run(n: int, a: int, b: int): int {
+		let mut c = 0
+		let mut i = n
+		while (i > 0) {
+			c = (a + b) * (a - b * (b - a) / (a + b) + a + b)
+			i -= 1
+		}
+		return c
+	}
+)";
+
+/* instructions one trip around the loop dispatches, from its backward jump */
+static int64_t loop_length(const Function& fn) {
+	for (auto& I : fn.code) {
+		if (I.op >= JMP && I.op <= BNZ && I.K < 0) {
+			return -I.K;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	int64_t n = argc > 1 ? atoll(argv[1]) : 10000000;
+
+	Environment env{};
+	auto module = compile(env, source);
+	auto run = module.function("run");
+	auto length = loop_length(*run);
+
+	VM vm;
+	Value args[] = {{.i64 = n}, {.i64 = 10}, {.i64 = 11}};
+	double best = 1e300;
+	for (int i = 0; i < 5; i++) {
+		auto t0 = std::chrono::steady_clock::now();
+		auto result = vm.call(*run, args);
+		auto t1 = std::chrono::steady_clock::now();
+		if (result.i64 != 651) {
+			fmt::print("wrong result {}\n", result.i64);
+			return 1;
+		}
+		best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count());
+	}
+
+	fmt::print("dispatch ({}): {} iterations x {} instructions, {:.2f} ms, {:.3f} ns/instruction\n",
+		L_COMPUTED_GOTO ? "computed goto" : "switch", n, length, best / 1e6, best / double(n * length));
+	return 0;
+}
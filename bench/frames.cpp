@@ -0,0 +1,111 @@
+#include "vm.hpp"
+#include "parser.h"
+
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include <fmt/format.h>
+
+/*
+ * Frame sizes the register allocator produces: for each script, the sum of
+ * stack_size over its functions and the largest. Without arguments, reports
+ * two generated scripts, one of sibling blocks and loops and one of deeply
+ * nested blocks, otherwise the script files given.
+ */
+
+/* compile() hands every function it finishes to dump(), main.cpp prints them */
+void dump(FuncState&) {}
+
+/* 200 functions of 3 to 8 sibling ifs, if/elses and loops, each declaring a few variables */
+static std::string siblings() {
+	std::mt19937 rng(7);
+	auto between = [&](int lo, int hi) {
+		return lo + int(rng() % (hi - lo + 1));
+	};
+
+	std::string src;
+	for (int f = 0; f < 200; f++) {
+		src += fmt::format("fn s{}(n: int, k: int): int {{\n\tlet mut acc = 0\n", f);
+		for (int b = 0, blocks = between(3, 8); b < blocks; b++) {
+			auto kind = rng() % 3;
+			if (kind == 0) {
+				src += fmt::format("\tlet mut i{0} = 0\n\twhile (i{0} < n) {{\n", b);
+			} else if (kind == 1) {
+				src += fmt::format("\tif (acc < k * {}) {{\n", b);
+			} else {
+				src += fmt::format("\tif (acc > {}) {{\n", b);
+			}
+			for (int v = 0, count = between(1, 5); v < count; v++) {
+				src += fmt::format("\t\tlet v{0} = acc * {1} + k - n / {2}\n\t\tacc += v{0} % 7\n", v, v + 1, v + 2);
+			}
+			if (kind == 0) {
+				src += fmt::format("\t\ti{} += 1\n", b);
+			} else if (kind == 2) {
+				src += "\t} else {\n";
+				for (int v = 0, count = between(1, 4); v < count; v++) {
+					src += fmt::format("\t\tlet w{0} = acc - {0} * k\n\t\tacc -= w{0} % 5\n", v);
+				}
+			}
+			src += "\t}\n";
+		}
+		src += "\treturn acc\n}\n";
+	}
+	return src;
+}
+
+/* 1280 functions of ifs nested 30 deep, each declaring two variables */
+static std::string nested() {
+	std::string src;
+	for (int f = 0; f < 1280; f++) {
+		src += fmt::format("fn generated_{}(p: int, q: int): int {{\n\tlet mut result = p\n", f);
+		for (int depth = 0; depth <= 30; depth++) {
+			std::string indent(depth + 1, '\t');
+			for (int v = 0; v < 2; v++) {
+				src += fmt::format("{0}let value_{1}_{2} = result + q * {2}\n{0}result += value_{1}_{2}\n", indent, depth, v);
+			}
+			if (depth < 30) {
+				src += indent + "if (result < q) {\n";
+			}
+		}
+		for (int depth = 30; depth-- > 0;) {
+			src += std::string(depth + 1, '\t') + "}\n";
+		}
+		src += "\treturn result\n}\n";
+	}
+	return src;
+}
+
+static void report(std::string_view name, const std::string& src) {
+	Environment env{};
+	compile(env, src);
+
+	size_t functions = 0, sum = 0, largest = 0;
+	for (auto const& fn : env.functions) {
+		if (fn.native == nullptr) {
+			functions++;
+			sum += fn.stack_size;
+			largest = std::max<size_t>(largest, fn.stack_size);
+		}
+	}
+	fmt::print("{:<24} {:>6} functions  stack_size sum {:>7}  largest {:>4}\n", name, functions, sum, largest);
+}
+
+int main(int argc, char** argv) {
+	if (argc == 1) {
+		report("siblings (generated)", siblings());
+		report("nested (generated)", nested());
+		return 0;
+	}
+	for (int i = 1; i < argc; i++) {
+		std::ifstream file(argv[i]);
+		if (!file) {
+			fmt::print("cannot read '{}'\n", argv[i]);
+			return 1;
+		}
+		std::stringstream text;
+		text << file.rdbuf();
+		report(argv[i], text.str());
+	}
+	return 0;
+}
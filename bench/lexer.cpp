@@ -0,0 +1,57 @@
+#include "lex.h"
+
+#include <chrono>
+#include <random>
+#include <string>
+
+#include <fmt/format.h>
+
+/*
+ * Lexer throughput over a generated source of keywords, identifiers,
+ * numbers and punctuation. Identifiers are drawn from a pool, as names are
+ * reused in real scripts.
+ */
+
+int main(int argc, char** argv) {
+	size_t size = (argc > 1 ? atoll(argv[1]) : 32) << 20;
+
+	std::mt19937 rng(42);
+	const char* keywords[] = {"let", "mut", "fn", "if", "else", "while", "return", "true", "false", "loop"};
+	std::vector<std::string> names(4096);
+	for (auto& name : names) {
+		int length = 1 + rng() % 12;
+		for (int i = 0; i < length; i++) {
+			name += char('a' + rng() % 26);
+		}
+	}
+
+	std::string src;
+	while (src.size() < size) {
+		switch (rng() % 6) {
+		case 0: src += keywords[rng() % 10]; break;
+		case 1: src += names[rng() % names.size()]; break;
+		case 2: src += std::to_string(rng() % 100000); break;
+		case 3: src += "+"; break;
+		case 4: src += "("; break;
+		case 5: src += "\n\t"; break;
+		}
+		src += ' ';
+	}
+
+	double best = 1e300;
+	size_t tokens = 0;
+	for (int i = 0; i < 5; i++) {
+		auto t0 = std::chrono::steady_clock::now();
+		LexState ls{src};
+		tokens = 0;
+		do {
+			ls.next();
+			tokens++;
+		} while (ls.token.type != token_type::end_of_source);
+		auto t1 = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+	}
+
+	fmt::print("lexer: {} MB, {} tokens, {:.1f} ms, {:.1f} MB/s\n", src.size() >> 20, tokens, best * 1e3, src.size() / best / 1e6);
+	return 0;
+}
@@ -0,0 +1,67 @@
+#include "vm.hpp"
+#include "parser.h"
+
+#include <chrono>
+#include <thread>
+
+#include <fmt/format.h>
+
+/*
+ * Scaling of one compiled Environment over threads, each with its own VM:
+ * every thread runs fib(n) 'per' times, from 1 thread up to the hardware's.
+ * Code and constants are shared read-only, so calls/s should grow with the
+ * thread count until the cores run out.
+ */
+
+/* compile() hands every function it finishes to dump(), main.cpp prints them */
+void dump(FuncState&) {}
+
+static const char* source = R"(
+	fn fib(n: int): int {
+		if (n < 2) {
+			return n
+		}
+		return fib(n - 1) + fib(n - 2)
+	}
+)";
+
+int main(int argc, char** argv) {
+	int64_t n = argc > 1 ? atoll(argv[1]) : 27;
+	int per = argc > 2 ? atoi(argv[2]) : 8;
+	int most = std::max(1u, std::thread::hardware_concurrency());
+
+	Environment env{};
+	auto module = compile(env, source);
+	auto fib = module.function("fib");
+
+	for (int threads = 1;; threads = std::min(threads * 2, most)) {
+		std::vector<int64_t> sums(threads);
+		auto t0 = std::chrono::steady_clock::now();
+		std::vector<std::thread> pool;
+		for (int t = 0; t < threads; t++) {
+			pool.emplace_back([&, t] {
+				VM vm;
+				Value arg{.i64 = n};
+				for (int i = 0; i < per; i++) {
+					sums[t] += vm.call(*fib, {&arg, 1}).i64;
+				}
+			});
+		}
+		for (auto& thread : pool) {
+			thread.join();
+		}
+		auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		for (auto sum : sums) {
+			if (sum != sums[0]) {
+				fmt::print("threads disagree on fib({})\n", n);
+				return 1;
+			}
+		}
+		fmt::print("threads {:>3}  {:>5} calls  {:>8.1f} ms  {:>8.1f} calls/s\n", threads, threads * per, ms, threads * per * 1000 / ms);
+		if (threads == most) {
+			break;
+		}
+	}
+	return 0;
+}
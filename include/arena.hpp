@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+/*
+ * A bump allocator. Memory is handed out from fixed-size chunks kept in a
+ * list and is only ever given back all at once: reset() rewinds to the
+ * first chunk and keeps the rest for reuse, so a run that allocates about
+ * as much as the one before it never calls the system allocator.
+ *
+ * Allocations bigger than a quarter chunk get a block of their own, which
+ * reset() frees. With 'recycle' set, chunks the arena lets go of (beyond
+ * MAX_RETAINED on reset, all of them when it is destroyed) go to a cache
+ * on the current thread, where the next arena to grow on it finds them.
+ *
+ * Allocations are 8-byte aligned and never move.
+ */
+struct Arena {
+	static constexpr size_t CHUNK_SIZE = 16384;
+	static constexpr size_t MAX_RETAINED = 64;	/* chunks kept by reset() */
+
+	struct Chunk {
+		Chunk* next;
+		size_t size;
+
+		char* data() {
+			return reinterpret_cast<char*>(this + 1);
+		}
+	};
+
+	Chunk* first = nullptr;
+	Chunk* current = nullptr;
+	Chunk* large = nullptr;	/* blocks of single big allocations */
+	char* cursor = nullptr;
+	size_t available = 0;
+	bool recycle = false;
+
+	/* statistics, in bytes */
+	size_t in_use = 0;	/* handed out since the last reset */
+	size_t peak = 0;	/* most ever in use at once */
+	size_t allocated = 0;	/* handed out over the arena's life */
+	size_t reserved = 0;	/* held in chunks and blocks right now */
+	size_t chunks = 0;
+	size_t resets = 0;
+
+	Arena() = default;
+	explicit Arena(bool recycle) : recycle(recycle) {}
+	Arena(const Arena&) = delete;
+	Arena(Arena&& other) noexcept
+		: first(std::exchange(other.first, nullptr))
+		, current(std::exchange(other.current, nullptr))
+		, large(std::exchange(other.large, nullptr))
+		, cursor(std::exchange(other.cursor, nullptr))
+		, available(std::exchange(other.available, 0))
+		, recycle(other.recycle)
+		, in_use(std::exchange(other.in_use, 0))
+		, peak(std::exchange(other.peak, 0))
+		, allocated(std::exchange(other.allocated, 0))
+		, reserved(std::exchange(other.reserved, 0))
+		, chunks(std::exchange(other.chunks, 0))
+		, resets(std::exchange(other.resets, 0)) {}
+	~Arena();
+
+	char* allocate(size_t size) {
+		size = (size + 7) & ~size_t(7);
+		if (size > available) {
+			return refill(size);
+		}
+		auto ptr = cursor;
+		cursor += size;
+		available -= size;
+		in_use += size;
+		allocated += size;
+		peak = in_use > peak ? in_use : peak;
+		return ptr;
+	}
+
+	/* forgets every allocation, their memory is reused by the next ones */
+	void reset();
+
+	/* the slow path of allocate(), moves to the next chunk or a block of its own */
+	char* refill(size_t size);
+	/* a chunk from the thread's cache or the system, and back */
+	Chunk* take_chunk();
+	void release(Chunk* chunk);
+};
+
+/* how many chunks the current thread's cache holds */
+extern size_t arena_cached_chunks();
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "func.hpp"
+
+/*
+ * Precompiled bytecode files. A file holds the constant pool of an
+ * Environment and every function: its name, signature, stack size,
+ * instructions and callees.
+ * Loading maps the file and links straight from the mapping, so nothing is
+ * lexed, parsed or optimized again.
+ *
+ * The format is tied to this build: files written with another version or
+ * opcode numbering are rejected and should be recompiled from source.
+ * Loading checks the structure of the code, not the types of the values it
+ * works on, so a file must come from a trusted writer: a function declared
+ * to return a string or struct is, for one, taken at its word by VM::call.
+ */
+
+constexpr uint16_t BYTECODE_VERSION = 5;
+
+/* writes every function of 'env' to 'path', returns false if it could not */
+extern bool save_bytecode(const Environment& env, const char* path);
+
+/*
+ * Fills 'env' from 'path', returns false if it is missing, stale or malformed.
+ * 'env' must hold nothing but the host functions declared when the file was
+ * saved, in the same order. Loaded functions carry only linked code, their
+ * Bytecode is empty.
+ */
+extern bool load_bytecode(Environment& env, const char* path);
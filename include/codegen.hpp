@@ -2,44 +2,60 @@
 
 #include "ir.hpp"
 
+#include <cstddef>
+#include <cstdint>
+#include <span>
 #include <vector>
 
 struct Bytecode {
 	std::vector<Instruction> instructions;
+	/* functions called from this code, CALL refers to them by position */
+	std::vector<uint32_t> callees;
+
+	/* appends 'I', behind a WIDE word if its operands need one, returns where 'I' went */
+	size_t emit(const WideInstruction& I);
 
 	size_t EmitABC(OPCODE op, uint32_t A, uint32_t B, uint32_t C) {
-		auto& I = instructions.emplace_back();
+		WideInstruction I{};
 		I.op = op;
 		I.A = A;
 		I.B = B;
 		I.C = C;
-		return instructions.size() - 1;
+		return emit(I);
+	}
+	size_t EmitABsC(OPCODE op, uint32_t A, uint32_t B, int32_t sC) {
+		WideInstruction I{};
+		I.op = op;
+		I.A = A;
+		I.B = B;
+		I.sC = sC;
+		return emit(I);
 	}
 	size_t EmitABx(OPCODE op, uint32_t A, uint32_t Bx) {
-		auto& I = instructions.emplace_back();
+		WideInstruction I{};
 		I.op = op;
 		I.A = A;
 		I.Bx = Bx;
-		return instructions.size() - 1;
+		return emit(I);
 	}
 	size_t EmitAsBx(OPCODE op, uint32_t A, int32_t sBx) {
-		auto& I = instructions.emplace_back();
+		WideInstruction I{};
 		I.op = op;
 		I.A = A;
 		I.sBx = sBx;
-		return instructions.size() - 1;
+		return emit(I);
 	}
 	size_t EmitAx(OPCODE op, uint32_t Ax) {
-		auto& I = instructions.emplace_back();
+		WideInstruction I{};
 		I.op = op;
 		I.Ax = Ax;
-		return instructions.size() - 1;
+		return emit(I);
 	}
 	size_t EmitsAx(OPCODE op, int32_t sAx) {
-		auto& I = instructions.emplace_back();
+		WideInstruction I{};
 		I.op = op;
 		I.sAx = sAx;
-		return instructions.size() - 1;
+		return emit(I);
 	}
 
 	size_t Store(uint32_t A, uint32_t B) {
@@ -50,6 +66,11 @@ struct Bytecode {
 		return EmitAsBx(ISTORE, sp, imm);
 	}
 
+	/* 'k' indexes Environment::constants */
+	size_t LoadK(uint32_t sp, uint32_t k) {
+		return EmitABx(LOADK, sp, k);
+	}
+
 	size_t AddInt(uint32_t A, uint32_t B, uint32_t C) {
 		return EmitABC(IADD, A, B, C);
 	}
@@ -70,34 +91,73 @@ struct Bytecode {
 		return EmitABC(IMOD, A, B, C);
 	}
 
-	size_t xPushChar(uint32_t sp) {
-		return EmitABC(xPUSHc, sp, 0, 0);
+	size_t CmpInt(uint32_t A, uint32_t B) {
+		return EmitABC(ICMP, A, B, 0);
 	}
-	size_t xPushShort(uint32_t sp) {
-		return EmitABC(xPUSHs, sp, 0, 0);
+
+	size_t CmpIntK(uint32_t A, int32_t sBx) {
+		return EmitAsBx(ICMPK, A, sBx);
 	}
-	size_t xPushInt(uint32_t sp) {
-		return EmitABC(xPUSHi, sp, 0, 0);
+
+	size_t Test(uint32_t A) {
+		return EmitABC(TEST, A, 0, 0);
 	}
-	size_t xPushLong(uint32_t sp) {
-		return EmitABC(xPUSHl, sp, 0, 0);
+
+	/* position of 'function' in 'callees', added on first use */
+	uint32_t callee(uint32_t function) {
+		size_t C = 0;
+		while (C < callees.size() && callees[C] != function) {
+			C++;
+		}
+		if (C == callees.size()) {
+			callees.emplace_back(function);
+		}
+		return C;
 	}
-	size_t xPushLongLong(uint32_t sp) {
-		return EmitABC(xPUSHll, sp, 0, 0);
+	size_t Call(uint32_t A, uint32_t B, uint32_t function) {
+		return EmitABC(CALL, A, B, callee(function));
 	}
-	size_t xPushFloat(uint32_t sp) {
-		return EmitABC(xPUSHf, sp, 0, 0);
+	/* 'op' is the xCALL variant for the native's return type */
+	size_t xCall(OPCODE op, uint32_t A, uint32_t B, uint32_t function) {
+		return EmitABC(op, A, B, callee(function));
 	}
-	size_t xPushDouble(uint32_t sp) {
-		return EmitABC(xPUSHd, sp, 0, 0);
+	size_t xBatch(uint32_t A, uint32_t B, uint32_t function) {
+		return EmitABC(xBATCH, A, B, callee(function));
 	}
-	size_t xPushPointer(uint32_t sp) {
-		return EmitABC(xPUSHp, sp, 0, 0);
+	size_t xFlush(uint32_t function) {
+		return EmitABC(xFLUSH, 0, 0, callee(function));
 	}
-	size_t xCallVoid(uint32_t sp) {
-		return EmitABC(xCALLv, sp, 0, 0);
+	void TailCall(size_t pc) {
+		instructions[pc].op = TAILCALL;
 	}
 	size_t Ret() {
 		return EmitABC(RET, 0, 0, 0);
 	}
-};
\ No newline at end of file
+	/* a struct in registers is returned as 'count' of them */
+	size_t Ret(uint32_t A, uint32_t count = 1) {
+		return EmitABC(RET, A, count, 0);
+	}
+
+	/* returns how many registers the optimized code still needs */
+	size_t optimize(size_t registers);
+};
+
+/* read-only Bytecode, the arrays may live in a mapped bytecode file */
+struct BytecodeView {
+	std::span<const Instruction> instructions;
+	std::span<const uint32_t> callees;
+
+	BytecodeView() = default;
+	BytecodeView(const Bytecode& ir)
+		: instructions(ir.instructions)
+		, callees(ir.callees) {}
+};
+
+/* the instruction at 'pc' with the WIDE word in front of it, if any, folded in */
+extern WideInstruction decode(std::span<const Instruction> code, size_t pc);
+
+/* one past the highest register 'code' refers to */
+extern size_t frame_size(std::span<const Instruction> code);
+
+/* true if control can run off the end of 'code' */
+extern bool falls_through(std::span<const Instruction> code);
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <dyncall.h>
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+union Value;
+
+/* calls 'fn' with arguments converted from 'args' as its signature says */
+using Trampoline = Value (*)(void* fn, const Value* args);
+
+/* a batched host function, 'records' holds 'count' calls' arguments back to back */
+using BatchFunction = void (*)(const Value* records, size_t count);
+
+/*
+ * A native function signature in dyncall notation: one code per argument,
+ * ')' and the return code, e.g. "ld)v" for void f(int64_t, double).
+ *
+ *   B bool  c char  s short  i int  j long  l int64_t
+ *   f float  d double  p pointer  v void (return only)
+ *
+ * Returns are limited to 'v', 'i', 'l', 'd' and 'p', one xCALL variant each.
+ *
+ * Signatures are interned by Environment::signature(). The common ones, up
+ * to MAX_TRAMPOLINE_ARGS arguments of 'i', 'l', 'd' and 'p', get a trampoline
+ * compiled into the interpreter that calls the function directly. The rest
+ * go through dyncall one argument at a time.
+ */
+struct Signature {
+	static constexpr size_t MAX_TRAMPOLINE_ARGS = 4;
+
+	std::string code;
+	Trampoline trampoline = nullptr;
+
+	std::string_view args() const {
+		return std::string_view(code).substr(0, code.size() - 2);
+	}
+	char ret() const {
+		return code.back();
+	}
+};
+
+/* returns false unless 'code' is a signature the FFI can call */
+extern bool parse_signature(Signature& signature, std::string_view code);
+
+/* loads 'args' into 'dc' for a dcCall* of a signature without a trampoline */
+extern void ffi_push(DCCallVM* dc, const Signature& signature, const Value* args);
@@ -1,12 +1,14 @@
 #pragma once
 
 #include "codegen.hpp"
+#include "ffi.hpp"
+#include "lstring.hpp"
 #include "type.hpp"
 
-#include <set>
+#include <algorithm>
 #include <string>
-#include <list>
-#include <stack>
+#include <deque>
+#include <optional>
 #include <unordered_map>
 
 #include <fmt/format.h>
@@ -18,57 +20,338 @@ struct Slot {
 struct Variable {
 	Slot slot;
 	Type type;
+	bool is_mutable = false;
+	std::optional<int64_t> constant = std::nullopt;
 };
 
-struct Scope {
-	std::unordered_map<std::string, Variable> variables;
+/* lets string-keyed maps be searched with a std::string_view */
+struct string_hash {
+	using is_transparent = void;
 
-	void declare(std::string name, Slot slot, Type type) {
-		if (variables.contains(name)) {
-			fmt::print("redefinition of '{}'", name);
-		}
-		variables.insert_or_assign(std::move(name), Variable{slot, std::move(type)});
+	size_t operator()(std::string_view s) const {
+		return std::hash<std::string_view>{}(s);
 	}
 };
 
+/* a variable in scope, 'symbol' is the name's id in LexState::symbols */
+struct Local {
+	uint32_t symbol;
+	Variable variable;
+};
+
 struct FuncState {
 	FuncState* top{nullptr};
 	Bytecode ir;
 
 	std::string name;
 	std::vector<std::string> args;
+	uint32_t index = 0;
+
+	/* registers are 8-bit operands, 16-bit behind a WIDE word */
+	static constexpr int MAX_REGISTERS = 65536;
+
+	/* where a block's variables and the registers they own start */
+	struct Block {
+		size_t locals;
+		size_t owned;
+	};
 
-	std::list<Scope> scopes;
-	std::stack<int> temp;
+	/* variables in scope, innermost last */
+	std::vector<Local> locals;
+	std::vector<Block> blocks;
+	/* batched host functions called in each enclosing loop, flushed when it exits */
+	std::vector<std::vector<uint32_t>> loops;
+	/* registers held by variables, given back when their block ends */
+	std::vector<int> owned;
+	/* free registers below stack_size, highest first, so the lowest is at the back */
+	std::vector<int> temp;
 	int stack_size = 0;
 
 	Slot allocate() {
 		if (temp.empty()) {
-			return { stack_size++ };
+			return grow();
 		}
-		int index = temp.top();
-		temp.pop();
+		int index = temp.back();
+		temp.pop_back();
 		return { index };
 	}
 	void deallocate(Slot slot) {
-		temp.push(slot.location);
+		auto it = std::lower_bound(temp.begin(), temp.end(), slot.location, std::greater<>{});
+		if (it == temp.end() || *it != slot.location) {
+			temp.insert(it, slot.location);
+		}
+	}
+	bool is_free(int location) const {
+		return std::binary_search(temp.begin(), temp.end(), location, std::greater<>{});
+	}
+	/* removes 'location' from the free registers, false if it was not free */
+	bool take(int location) {
+		auto it = std::lower_bound(temp.begin(), temp.end(), location, std::greater<>{});
+		if (it == temp.end() || *it != location) {
+			return false;
+		}
+		temp.erase(it);
+		return true;
+	}
+
+	/* 'count' consecutive registers, for values that take several */
+	Slot allocate(int count) {
+		if (count == 1) {
+			return allocate();
+		}
+		int first = free_top();
+		for (int i = 0; i < count; i++) {
+			claim(first + i);
+		}
+		return { first };
+	}
+
+	/* takes a specific register, which must be free or the next one past the frame */
+	Slot claim(int location) {
+		if (location == stack_size) {
+			grow();
+		} else if (!take(location)) {
+			fmt::print("register %{} is in use\n", location);
+			abort();
+		}
+		return { location };
+	}
+
+	/* the lowest register with nothing in use at or above it */
+	int free_top() const {
+		int top = stack_size;
+		while (top > 0 && is_free(top - 1)) {
+			top--;
+		}
+		return top;
 	}
 
-	void declare(std::string name, Slot slot, Type type) {
-		scopes.front().declare(std::move(name), slot, std::move(type));
+	Slot grow() {
+		if (stack_size == MAX_REGISTERS) {
+			fmt::print("'{}' needs more than {} registers\n", name, MAX_REGISTERS);
+			abort();
+		}
+		return { stack_size++ };
+	}
+
+	/* hands 'slot' to the current block, it is freed when the block ends */
+	void own(Slot slot) {
+		owned.push_back(slot.location);
+	}
+
+	void enter_block() {
+		blocks.push_back({locals.size(), owned.size()});
 	}
 
-	Variable get(const std::string& name) {
-		for (auto& scope : scopes) {
-			auto it = scope.variables.find(name);
-			if (it != scope.variables.end()) {
-				return it->second;
+	/* sibling blocks reuse the registers of the ones before them */
+	void leave_block() {
+		for (size_t i = blocks.back().owned; i < owned.size(); i++) {
+			deallocate({owned[i]});
+		}
+		locals.resize(blocks.back().locals);
+		owned.resize(blocks.back().owned);
+		blocks.pop_back();
+	}
+
+	/* returns false when the innermost block already declares 'symbol', which is then rebound */
+	bool declare(uint32_t symbol, Variable variable) {
+		for (size_t i = locals.size(); i-- > blocks.back().locals;) {
+			if (locals[i].symbol == symbol) {
+				locals[i].variable = std::move(variable);
+				return false;
 			}
 		}
-		fmt::print("'{}' is not defined\n", name);
-		abort();
+		locals.push_back({symbol, std::move(variable)});
+		return true;
 	}
+
+	Variable* find(uint32_t symbol) {
+		for (size_t i = locals.size(); i-- > 0;) {
+			if (locals[i].symbol == symbol) {
+				return &locals[i].variable;
+			}
+		}
+		return nullptr;
+	}
+};
+
+struct Function {
+	std::string name;
+	FunctionType* type = nullptr;
+	bool defined = false;
+
+	int stack_size = 0;
+	Bytecode ir;
+	std::vector<LinkedInstruction> code;
+
+	/* set for host functions, which are called through their signature */
+	void* native = nullptr;
+	const Signature* signature = nullptr;
+	/* for batched host functions, records per call and their VM buffer */
+	uint32_t batch_capacity = 0;
+	uint32_t batch_index = 0;
 };
 
+/*
+ * Only compile() and load_bytecode() write an Environment. Once they return
+ * it is read-only and can be shared by VMs on any number of threads, as long
+ * as nothing is compiled into it while they run.
+ */
 struct Environment {
+	/* a deque keeps Function addresses stable, linked CALLs point at them */
+	std::deque<Function> functions;
+	std::unordered_map<std::string, uint32_t, string_hash, std::equal_to<>> function_index;
+	/* interned native signatures, nodes keep their addresses */
+	std::unordered_map<std::string, Signature, string_hash, std::equal_to<>> signatures;
+	/* how many batched host functions are declared */
+	uint32_t batches = 0;
+	/* struct types by name, a deque keeps the addresses Types hold stable */
+	std::deque<StructType> structs;
+	std::unordered_map<std::string, StructType*, string_hash, std::equal_to<>> struct_index;
+	/* the types of all functions, a deque keeps the addresses Function::type holds stable */
+	std::deque<FunctionType> types;
+
+	/*
+	 * The raw bits of every value LOADK refers to, for all functions, each
+	 * kept once. link() copies them into the linked instructions.
+	 */
+	std::vector<int64_t> constants;
+	std::unordered_map<int64_t, uint32_t> constant_index;
+	/* the bodies of string literals too long to be inline, keyed by their text */
+	std::unordered_map<std::string_view, const String*> strings;
+	Arena literals;
+
+	/* finds a function by name, adding an undefined entry on first use */
+	uint32_t function(std::string_view name) {
+		auto it = function_index.find(name);
+		if (it != function_index.end()) {
+			return it->second;
+		}
+		auto index = uint32_t(functions.size());
+		functions.emplace_back().name = name;
+		function_index.emplace(name, index);
+		return index;
+	}
+
+	/* a new function type returning 'return_type', its arguments are added by the caller */
+	FunctionType* function_type(Type return_type) {
+		return &types.emplace_back(FunctionType{return_type, {}});
+	}
+
+	/* the interned signature for 'code', or null if it is malformed */
+	const Signature* signature(std::string_view code) {
+		auto it = signatures.find(code);
+		if (it != signatures.end()) {
+			return &it->second;
+		}
+		Signature signature;
+		if (!parse_signature(signature, code)) {
+			return nullptr;
+		}
+		return &signatures.emplace(code, std::move(signature)).first->second;
+	}
+
+	/* the index of the constant with bits 'bits', added on first use */
+	uint32_t constant(int64_t bits) {
+		auto [it, added] = constant_index.emplace(bits, uint32_t(constants.size()));
+		if (added) {
+			constants.push_back(bits);
+		}
+		return it->second;
+	}
+
+	/* the bits of string literal 'text', equal literals share one body */
+	int64_t string(std::string_view text) {
+		if (text.size() <= MAX_INLINE_STRING) {
+			return int64_t(make_string(literals, text));
+		}
+		auto it = strings.find(text);
+		if (it == strings.end()) {
+			auto body = string_body(make_string(literals, text));
+			it = strings.emplace(std::string_view(body->data(), body->size), body).first;
+		}
+		return reinterpret_cast<int64_t>(it->second);
+	}
+
+	/* the script type of a signature code, pointers are carried as ints */
+	static Type native_type(char code) {
+		switch (code) {
+		case 'v': return VoidType{};
+		case 'B': return BoolType{};
+		case 'f':
+		case 'd': return FloatType{};
+		default: return IntType{};
+		}
+	}
+
+	/* declares the host function 'fn' to scripts as 'name' */
+	uint32_t native(std::string_view name, void* fn, std::string_view code) {
+		auto index = function(name);
+		auto& f = functions[index];
+		if (f.defined) {
+			fmt::print("redefinition of '{}'\n", name);
+			abort();
+		}
+		f.signature = signature(code);
+		if (f.signature == nullptr) {
+			fmt::print("'{}' has an invalid signature '{}'\n", name, code);
+			abort();
+		}
+
+		auto type = function_type(native_type(f.signature->ret()));
+		for (auto c : f.signature->args()) {
+			type->args.emplace_back(native_type(c));
+		}
+		f.type = type;
+		f.native = fn;
+		f.defined = true;
+		return index;
+	}
+
+	/*
+	 * Declares a host function that takes its calls in batches. The VM keeps
+	 * each call's arguments as a record of Values and hands the host up to
+	 * 'capacity' records at once, when the loop making the calls exits or the
+	 * buffer is full. The signature describes one record, it returns void and
+	 * takes at least one 'l', 'd' or 'p' argument.
+	 */
+	uint32_t batch(std::string_view name, BatchFunction fn, std::string_view code, uint32_t capacity = 256) {
+		auto args = code.substr(0, code.find(')'));
+		if (args.empty() || args.find_first_not_of("ldp") != std::string_view::npos || code.substr(args.size()) != ")v" || capacity == 0) {
+			fmt::print("'{}' has an invalid batch signature '{}'\n", name, code);
+			abort();
+		}
+		auto index = native(name, reinterpret_cast<void*>(fn), code);
+		functions[index].batch_capacity = capacity;
+		functions[index].batch_index = batches++;
+		return index;
+	}
+
+	/* the defined function called 'name', or null */
+	const Function* find(std::string_view name) const {
+		auto it = function_index.find(name);
+		if (it == function_index.end() || !functions[it->second].defined) {
+			return nullptr;
+		}
+		return &functions[it->second];
+	}
+
+	/* the struct type called 'name', or null */
+	StructType* find_struct(std::string_view name) const {
+		auto it = struct_index.find(name);
+		return it == struct_index.end() ? nullptr : it->second;
+	}
+};
+
+/*
+ * A compiled source, ready to run any number of times on any VM. Its code
+ * lives in the Environment it was compiled into, which must outlive it.
+ */
+struct Module {
+	const Environment* env = nullptr;
+	const Function* main = nullptr;
+
+	const Function* function(std::string_view name) const {
+		return env->find(name);
+	}
 };
\ No newline at end of file
@@ -2,44 +2,100 @@
 
 #include <cstdint>
 
-struct Instruction {
-	uint8_t op: 8;
+struct Function;
 
+/*
+ * A 32-bit word: the opcode and its operands in one of four layouts,
+ *
+ *   A B C	8 bits each, C may be signed (sC)
+ *   A Bx	8 and 16 bits, Bx may be signed (sBx)
+ *   sAx	24 bits, jump targets
+ *
+ * A WIDE word in front of an instruction holds the high bits of its
+ * operands, giving A, B and C 16 bits and Bx 32. decode() puts the two
+ * together.
+ */
+struct Instruction {
 	union {
-		std::int32_t sAx: 24;
-		std::uint32_t Ax: 24;
 		struct {
-			std::int32_t sA: 8;
+			std::uint32_t op: 8;
 			std::uint32_t A: 8;
-			union {
-				std::int32_t sBx: 16;
-				std::uint32_t Bx: 16;
-				struct {
-					union {
-						std::int32_t sB: 8;
-						std::uint32_t B: 8;
-					};
-					union {
-						std::int32_t sC: 8;
-						std::uint32_t C: 8;
-					};
-				};
-			};
+			std::uint32_t B: 8;
+			std::uint32_t C: 8;
+		};
+		struct {
+			std::uint32_t: 24;
+			std::int32_t sC: 8;
+		};
+		struct {
+			std::uint32_t: 16;
+			std::uint32_t Bx: 16;
+		};
+		struct {
+			std::uint32_t: 16;
+			std::int32_t sBx: 16;
+		};
+		struct {
+			std::uint32_t: 8;
+			std::uint32_t Ax: 24;
+		};
+		struct {
+			std::uint32_t: 8;
+			std::int32_t sAx: 24;
 		};
 	};
 };
 
+static_assert(sizeof(Instruction) == 4);
+
+/* an Instruction with its WIDE prefix folded in, every operand at full width */
+struct WideInstruction {
+	std::uint8_t op;
+	union {
+		std::uint32_t A;
+		std::uint32_t Ax;
+		std::int32_t sAx;
+	};
+	union {
+		std::uint32_t B;
+		std::uint32_t Bx;
+		std::int32_t sBx;
+	};
+	union {
+		std::uint32_t C;
+		std::int32_t sC;
+	};
+};
+
 enum OPCODE : uint8_t {
 	NOP,
 	LOAD,
 	ISTORE,
+	LOADK,	// A = Environment::constants[Bx]
 	IADD,
 	ISUB,
 	IMUL,
 	IDIV,
 	IMOD,
+	INEG,
 	ICMP,
 	TEST,
+	FADD,
+	FSUB,
+	FMUL,
+	FDIV,
+	FNEG,
+	FCMP,
+	NOT,	// A = !B for bools
+	CONCAT,	// A = B .. C
+	SLEN,	// A = #B
+	SEQ,	// flags = A == B for strings, unordered when they differ
+	SCMP,	// flags = A <=> B for strings
+	NEWSTRUCT,	// A = a new struct block of B slots, left for the caller to fill
+	GETFIELD,	// A = slot C of the block in B
+	SETFIELD,	// slot B of the block in A = C
+	FIELDPTR,	// A = the address of slot C of the block in B, for nested structs
+	SCOPY,	// copies C slots from the block in B to the block in A
 	JMP,
 	JE,
 	JNE,
@@ -47,16 +103,63 @@ enum OPCODE : uint8_t {
 	JLE,
 	JGT,
 	JGE,
-	CALL,
-	xCALLv,
-	xPUSHb,
-	xPUSHc,
-	xPUSHs,
-	xPUSHi,
-	xPUSHl,
-	xPUSHll,
-	xPUSHf,
-	xPUSHd,
-	xPUSHp,
-	RET
-};
\ No newline at end of file
+
+	/* superinstructions produced by Bytecode::optimize */
+	IADDK,	// A = B + sC
+	ISUBK,	// A = B - sC
+	IMULK,	// A = B * sC
+	IDIVK,	// A = B / sC
+	IMODK,	// A = B % sC
+	ICMPK,	// flags = A <=> sBx
+
+	/* compare-and-branch: the following JMP holds the target and is skipped when not taken */
+	BEQ,	// A == B
+	BNE,	// A != B
+	BLT,	// A < B
+	BLE,	// A <= B
+	BGT,	// A > B
+	BGE,	// A >= B
+	BEQK,	// A == sBx
+	BNEK,	// A != sBx
+	BLTK,	// A < sBx
+	BLEK,	// A <= sBx
+	BGTK,	// A > sBx
+	BGEK,	// A >= sBx
+	BZ,		// A == 0
+	BNZ,	// A != 0
+
+	CALL,	// calls callee C with B arguments in the registers from A, the result lands in A
+	TAILCALL,	// like CALL, but moves the arguments to %0 and replaces the current call
+	xCALLv,	// calls native callee C with B arguments in the registers from A
+	xCALLi,	// like xCALLv, the callee's int result lands in A
+	xCALLl,	// ... an int64_t result
+	xCALLd,	// ... a double result
+	xCALLp,	// ... a pointer result
+	xBATCH,	// appends the B arguments from A as a record to batched callee C
+	xFLUSH,	// hands the records buffered for callee C over to it
+	RET,	// returns the B registers from A, structs may take several
+	WIDE,	// high operand bits of the next instruction, absorbed by link()
+
+	NUM_OPCODES
+};
+
+/*
+ * Execution form of an Instruction, produced from Bytecode by link().
+ * Operands are sign/zero extended once at link time, jumps are stored as
+ * offsets relative to the next instruction, CALL points at its callee, and
+ * with computed-goto dispatch 'handler' points directly at the opcode's
+ * handler in the interpreter.
+ */
+struct alignas(32) LinkedInstruction {
+	const void* handler;
+	std::int32_t A;
+	std::int32_t B;
+	std::int32_t C;
+	OPCODE op;
+	union {
+		std::int64_t K;
+		const Function* callee;
+	};
+};
+
+static_assert(sizeof(LinkedInstruction) == 32);
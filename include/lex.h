@@ -9,6 +9,8 @@
 #include <list>
 #include <stack>
 #include <set>
+#include <memory>
+#include <string_view>
 
 #include "codegen.hpp"
 
@@ -40,6 +42,7 @@ enum token_type : uint8_t {
 	kw_import,
 	kw_export,
 	kw_match,
+	kw_mut,
 
 	plus,
 	minus,
@@ -85,12 +88,17 @@ enum token_type : uint8_t {
 	args
 };
 
+/*
+ * Tokens never own memory: 'string' views the source text, or the string
+ * arena for literals that contained escapes, and identifiers carry the id
+ * LexState::symbols interned them to.
+ */
 struct Token {
 	token_type type;
-	int32_t integer;
+	int64_t integer;
 	double number;
-	std::string string;
-	std::string_view raw_string;
+	uint32_t symbol;
+	std::string_view string;
 
 	static auto to_string(token_type type) {
 		switch (type) {
@@ -224,17 +232,34 @@ struct Token {
 			return "export";
 		case kw_match:
 			return "match";
+		case kw_mut:
+			return "mut";
 		}
 		return "[token]";
 	}
 };
 
+/* interns names to dense ids, the names themselves stay in the source */
+struct SymbolTable {
+	std::vector<std::string_view> names;
+	std::vector<uint32_t> slots;	/* id + 1, 0 is empty */
+
+	uint32_t intern(std::string_view name);
+
+	std::string_view name(uint32_t id) const {
+		return names[id];
+	}
+};
+
 struct LexState {
 	FuncState* fs = nullptr;
 
 	Token prev_token;
 	Token token;
 
+	SymbolTable symbols;
+	Arena strings;	/* text of literals that contained escapes */
+
 	std::string_view src;
 	size_t line_number = 0;
 	size_t char_index = 0;
@@ -274,7 +299,7 @@ struct LexState {
 	token_type read_token();
 
 	void next() {
-		prev_token = std::move(token);
+		prev_token = token;
 		token.type = read_token();
 	}
 };
\ No newline at end of file
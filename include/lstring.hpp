@@ -0,0 +1,86 @@
+#pragma once
+
+#include "arena.hpp"
+
+#include <bit>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+ * Script strings are immutable and fit in one Value. Strings of up to
+ * MAX_INLINE_STRING bytes are stored in the Value itself: its first byte
+ * holds size << 1 | 1 and the bytes follow, zero padded. Longer strings
+ * point at a String body, which is 8-byte aligned, so the low bit tells the
+ * two apart.
+ *
+ * Every string has exactly one representation, so two inline strings are
+ * equal when their bits are, and an inline string never equals a body.
+ * Bodies carry their hash, which settles most unequal comparisons without
+ * looking at the text.
+ *
+ * Bodies are never freed one by one, they live in the Arena of whoever
+ * made them: the Environment for literals, the VM for strings built during
+ * a call.
+ */
+
+static_assert(std::endian::native == std::endian::little, "inline strings start at the Value's first byte");
+
+constexpr size_t MAX_INLINE_STRING = 7;
+
+struct String {
+	uint32_t size;
+	uint32_t hash;
+
+	/* the text, NUL terminated */
+	const char* data() const {
+		return reinterpret_cast<const char*>(this + 1);
+	}
+};
+
+inline bool is_inline_string(uint64_t bits) {
+	return bits & 1;
+}
+
+inline const String* string_body(uint64_t bits) {
+	return reinterpret_cast<const String*>(bits);
+}
+
+inline size_t string_size(uint64_t bits) {
+	return is_inline_string(bits) ? (bits & 0xff) >> 1 : string_body(bits)->size;
+}
+
+/* the text of the string held in 'bits', valid while 'bits' is */
+inline std::string_view string_view(const uint64_t& bits) {
+	if (is_inline_string(bits)) {
+		return {reinterpret_cast<const char*>(&bits) + 1, string_size(bits)};
+	}
+	return {string_body(bits)->data(), string_body(bits)->size};
+}
+
+/* the string 'text', with a body from 'arena' if it is too long to be inline */
+extern uint64_t make_string(Arena& arena, std::string_view text);
+
+/* 'lhs' followed by 'rhs' */
+extern uint64_t string_concat(Arena& arena, uint64_t lhs, uint64_t rhs);
+
+inline bool string_equal(uint64_t lhs, uint64_t rhs) {
+	if (lhs == rhs) {
+		return true;
+	}
+	if (is_inline_string(lhs) || is_inline_string(rhs)) {
+		return false;
+	}
+	auto a = string_body(lhs);
+	auto b = string_body(rhs);
+	return a->size == b->size && a->hash == b->hash && string_view(lhs) == string_view(rhs);
+}
+
+/* byte-wise lexicographic order */
+inline std::strong_ordering string_compare(const uint64_t& lhs, const uint64_t& rhs) {
+	if (lhs == rhs) {
+		return std::strong_ordering::equal;
+	}
+	return string_view(lhs) <=> string_view(rhs);
+}
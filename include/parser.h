@@ -2,4 +2,8 @@
 
 #include "func.hpp"
 
-extern void parse(Environment& env, std::string_view src);
\ No newline at end of file
+/*
+ * Compiles 'src' into 'env' without running it. The top-level code becomes
+ * the function 'name' and every function it defines is added to 'env'.
+ */
+extern Module compile(Environment& env, std::string_view src, std::string_view name = "main");
\ No newline at end of file
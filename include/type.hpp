@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <variant>
 
@@ -10,9 +13,7 @@ struct IntType {};
 struct FloatType {};
 struct StringType {};
 struct FunctionType;
-struct StructType {
-	std::vector<Type> fields;
-};
+struct StructType;
 
 struct Type : std::variant<
 	VoidType,
@@ -21,7 +22,7 @@ struct Type : std::variant<
 	FloatType,
 	StringType,
 	FunctionType*,
-	StructType
+	StructType*
 > {
 	using variant::variant;
 	using variant::operator=;
@@ -30,4 +31,56 @@ struct Type : std::variant<
 struct FunctionType {
 	Type return_type;
 	std::vector<Type> args;
-};
\ No newline at end of file
+};
+
+/*
+ * Fields take one Value slot each, in declaration order, and a field that
+ * is itself a struct is laid out inline, so every field of a nested struct
+ * sits at a fixed offset from the start of the outermost one.
+ *
+ * Structs of up to MAX_REGISTER_SLOTS slots live in that many consecutive
+ * registers. Larger ones are a block in the VM heap, a register holds its
+ * address.
+ */
+struct StructType {
+	static constexpr uint32_t MAX_REGISTER_SLOTS = 4;
+	static constexpr uint32_t MAX_SLOTS = 65535;
+
+	std::string name;
+	std::vector<std::string> names;
+	std::vector<Type> fields;
+	std::vector<uint32_t> offsets;
+	uint32_t size = 0;	/* slots */
+	std::vector<uint32_t> strings;	/* slots holding strings, nested ones included */
+
+	bool in_registers() const {
+		return size <= MAX_REGISTER_SLOTS;
+	}
+
+	/* the index of field 'name', or -1 */
+	int field(std::string_view name) const {
+		for (size_t i = 0; i < names.size(); i++) {
+			if (names[i] == name) {
+				return int(i);
+			}
+		}
+		return -1;
+	}
+};
+
+inline StructType* as_struct(const Type& type) {
+	auto s = std::get_if<StructType*>(&type);
+	return s ? *s : nullptr;
+}
+
+/* how many slots a field of 'type' takes */
+inline uint32_t slots(const Type& type) {
+	auto s = as_struct(type);
+	return s ? s->size : 1;
+}
+
+/* how many registers a value of 'type' takes */
+inline uint32_t registers(const Type& type) {
+	auto s = as_struct(type);
+	return s && s->in_registers() ? s->size : 1;
+}
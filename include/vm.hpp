@@ -5,6 +5,7 @@
 #include <dyncall.h>
 #include <cstdint>
 #include <span>
+#include <vector>
 
 #include "func.hpp"
 
@@ -15,16 +16,69 @@ union Value {
 	void* p;
 };
 
+/* the stack may move when it grows, so frames remember offsets into it */
+struct Frame {
+	const LinkedInstruction* ip;
+	size_t base;
+};
+
+/* calls to a batched host function not handed over yet */
+struct Batch {
+	const Function* fn = nullptr;
+	std::vector<Value> records;	/* room for batch_capacity records */
+	size_t size = 0;	/* Values in use */
+};
+
+/*
+ * An idle VM owns no memory. The register stack is allocated on the first
+ * call and grows by relocation, each call checks that the callee's whole
+ * frame fits before entering it.
+ *
+ * Everything a running script writes lives in its VM: registers, frames,
+ * comparison flags (locals of execute), batch buffers, the heap and the
+ * dyncall state. Linked code is only read, so any number of VMs may run the same
+ * Environment's functions on different threads at once. One VM belongs to
+ * one thread at a time.
+ */
 struct VM {
-	DCCallVM* dc;
-	Value stack[1000];
-	Value* sp = std::end(stack);
+	static constexpr size_t MIN_STACK = 64;
+	static constexpr size_t MAX_STACK = 1000000;
 
-	size_t ip = 0;
-	std::partial_ordering cmp_flag = std::partial_ordering::unordered;
+	DCCallVM* dc = nullptr;
+	std::vector<Value> stack;
+	std::vector<Frame> frames;
+	size_t high_water = 0;	/* most stack slots ever in use */
+	std::vector<Batch> batches;	/* by Function::batch_index */
+	/* strings and objects made during a call, reset when it returns */
+	Arena heap{true};
 
-	VM();
+	VM() = default;
+	VM(const VM&) = delete;
 	~VM();
 
-	void call(FuncState& fs);
-};
\ No newline at end of file
+	/*
+	 * Runs 'fn' and resets the heap. Arguments may live in the heap, a
+	 * string or struct result is copied back into it after the reset, so
+	 * it stays valid until the next call. A struct kept in registers comes
+	 * back in the first slots of 'stack', the returned Value is the first.
+	 */
+	Value call(const Function& fn, std::span<const Value> args = {});
+
+	/* makes room for 'size' slots from 'sp', returns 'sp' in the new stack */
+	Value* grow(Value* sp, size_t size);
+	DCCallVM* ffi();
+
+	/* the buffer for batched host function 'fn' */
+	Batch& batch(const Function& fn) {
+		if (fn.batch_index < batches.size() && batches[fn.batch_index].fn == &fn) {
+			return batches[fn.batch_index];
+		}
+		return attach(fn);
+	}
+	Batch& attach(const Function& fn);
+	/* hands the buffered records to the host function */
+	void flush(Batch& batch);
+};
+
+extern void link(Function& fn, const Environment& env);
+extern void link(Function& fn, const BytecodeView& ir, const Environment& env);
\ No newline at end of file
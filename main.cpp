@@ -24,7 +24,11 @@ void dump(FuncState& fs) {
 	fmt::print(")\n");
 	fmt::print(".stack_size {}\n", fs.stack_size);
 
-	for (auto const& I : fs.ir.instructions) {
+	for (; pc < fs.ir.instructions.size(); pc++) {
+		if (fs.ir.instructions[pc].op == WIDE) {
+			continue;
+		}
+		auto I = decode(fs.ir.instructions, pc);
 		switch ((OPCODE) I.op) {
 		case NOP:
 			fmt::print("{}: nop\n", pc, I.A, I.Bx);
@@ -33,7 +37,10 @@ void dump(FuncState& fs) {
 			fmt::print("{}: load   %{} %{}\n", pc, I.A, I.B);
 			break;
 		case ISTORE:
-			fmt::print("{}: istore %{} {}\n", pc, I.A, I.Bx);
+			fmt::print("{}: istore %{} {}\n", pc, I.A, I.sBx);
+			break;
+		case LOADK:
+			fmt::print("{}: loadk  %{} k{}\n", pc, I.A, I.Bx);
 			break;
 		case IADD:
 			fmt::print("{}: iadd   %{} %{} %{}\n", pc, I.A, I.B, I.C);
@@ -50,8 +57,59 @@ void dump(FuncState& fs) {
 		case IMOD:
 			fmt::print("{}: imod   %{} %{} %{}\n", pc, I.A, I.B, I.C);
 			break;
+		case INEG:
+			fmt::print("{}: ineg   %{} %{}\n", pc, I.A, I.B);
+			break;
+		case FADD:
+			fmt::print("{}: fadd   %{} %{} %{}\n", pc, I.A, I.B, I.C);
+			break;
+		case FSUB:
+			fmt::print("{}: fsub   %{} %{} %{}\n", pc, I.A, I.B, I.C);
+			break;
+		case FMUL:
+			fmt::print("{}: fmul   %{} %{} %{}\n", pc, I.A, I.B, I.C);
+			break;
+		case FDIV:
+			fmt::print("{}: fdiv   %{} %{} %{}\n", pc, I.A, I.B, I.C);
+			break;
+		case FNEG:
+			fmt::print("{}: fneg   %{} %{}\n", pc, I.A, I.B);
+			break;
+		case FCMP:
+			fmt::print("{}: fcmp   %{} %{}\n", pc, I.A, I.B);
+			break;
+		case NOT:
+			fmt::print("{}: not    %{} %{}\n", pc, I.A, I.B);
+			break;
 		case ICMP:
-			fmt::print("{}: icmp   %{} {}\n", pc, I.A, I.B);
+			fmt::print("{}: icmp   %{} %{}\n", pc, I.A, I.B);
+			break;
+		case CONCAT:
+			fmt::print("{}: concat %{} %{} %{}\n", pc, I.A, I.B, I.C);
+			break;
+		case SLEN:
+			fmt::print("{}: slen   %{} %{}\n", pc, I.A, I.B);
+			break;
+		case SEQ:
+			fmt::print("{}: seq    %{} %{}\n", pc, I.A, I.B);
+			break;
+		case SCMP:
+			fmt::print("{}: scmp   %{} %{}\n", pc, I.A, I.B);
+			break;
+		case NEWSTRUCT:
+			fmt::print("{}: newstruct %{} {}\n", pc, I.A, I.B);
+			break;
+		case GETFIELD:
+			fmt::print("{}: getfield %{} %{}[{}]\n", pc, I.A, I.B, I.C);
+			break;
+		case SETFIELD:
+			fmt::print("{}: setfield %{}[{}] %{}\n", pc, I.A, I.B, I.C);
+			break;
+		case FIELDPTR:
+			fmt::print("{}: fieldptr %{} %{}[{}]\n", pc, I.A, I.B, I.C);
+			break;
+		case SCOPY:
+			fmt::print("{}: scopy  %{} %{} {}\n", pc, I.A, I.B, I.C);
 			break;
 		case TEST:
 			fmt::print("{}: test   %{}\n", pc, I.A);
@@ -77,51 +135,113 @@ void dump(FuncState& fs) {
 		case JGE:
 			fmt::print("{}: jge    ${}\n", pc, I.sAx);
 			break;
-		case CALL:
-			fmt::print("{}: call: unimplemented\n", pc);
+		case IADDK:
+			fmt::print("{}: iaddk  %{} %{} {}\n", pc, I.A, I.B, I.sC);
 			break;
-		case xCALLv:
-			fmt::print("{}: xcallv: unimplemented\n", pc);
+		case ISUBK:
+			fmt::print("{}: isubk  %{} %{} {}\n", pc, I.A, I.B, I.sC);
 			break;
-		case xPUSHb:
-			fmt::print("{}: xpushb: unimplemented\n", pc);
+		case IMULK:
+			fmt::print("{}: imulk  %{} %{} {}\n", pc, I.A, I.B, I.sC);
 			break;
-		case xPUSHc:
-			fmt::print("{}: xpushc: unimplemented\n", pc);
+		case IDIVK:
+			fmt::print("{}: idivk  %{} %{} {}\n", pc, I.A, I.B, I.sC);
 			break;
-		case xPUSHs:
-			fmt::print("{}: xpushs: unimplemented\n", pc);
+		case IMODK:
+			fmt::print("{}: imodk  %{} %{} {}\n", pc, I.A, I.B, I.sC);
 			break;
-		case xPUSHi:
-			fmt::print("{}: xpushi: unimplemented\n", pc);
+		case ICMPK:
+			fmt::print("{}: icmpk  %{} {}\n", pc, I.A, I.sBx);
 			break;
-		case xPUSHl:
-			fmt::print("{}: xpushl: unimplemented\n", pc);
+		case BEQ:
+			fmt::print("{}: beq    %{} %{}\n", pc, I.A, I.B);
 			break;
-		case xPUSHll:
-			fmt::print("{}: xpushll: unimplemented\n", pc);
+		case BNE:
+			fmt::print("{}: bne    %{} %{}\n", pc, I.A, I.B);
 			break;
-		case xPUSHf:
-			fmt::print("{}: xpushf: unimplemented\n", pc);
+		case BLT:
+			fmt::print("{}: blt    %{} %{}\n", pc, I.A, I.B);
 			break;
-		case xPUSHd:
-			fmt::print("{}: xpushd: unimplemented\n", pc);
+		case BLE:
+			fmt::print("{}: ble    %{} %{}\n", pc, I.A, I.B);
 			break;
-		case xPUSHp:
-			fmt::print("{}: xpushp: unimplemented\n", pc);
+		case BGT:
+			fmt::print("{}: bgt    %{} %{}\n", pc, I.A, I.B);
+			break;
+		case BGE:
+			fmt::print("{}: bge    %{} %{}\n", pc, I.A, I.B);
+			break;
+		case BEQK:
+			fmt::print("{}: beqk   %{} {}\n", pc, I.A, I.sBx);
+			break;
+		case BNEK:
+			fmt::print("{}: bnek   %{} {}\n", pc, I.A, I.sBx);
+			break;
+		case BLTK:
+			fmt::print("{}: bltk   %{} {}\n", pc, I.A, I.sBx);
+			break;
+		case BLEK:
+			fmt::print("{}: blek   %{} {}\n", pc, I.A, I.sBx);
+			break;
+		case BGTK:
+			fmt::print("{}: bgtk   %{} {}\n", pc, I.A, I.sBx);
+			break;
+		case BGEK:
+			fmt::print("{}: bgek   %{} {}\n", pc, I.A, I.sBx);
+			break;
+		case BZ:
+			fmt::print("{}: bz     %{}\n", pc, I.A);
+			break;
+		case BNZ:
+			fmt::print("{}: bnz    %{}\n", pc, I.A);
+			break;
+		case CALL:
+			fmt::print("{}: call   %{} {} @{}\n", pc, I.A, I.B, fs.ir.callees[I.C]);
+			break;
+		case TAILCALL:
+			fmt::print("{}: tcall  %{} {} @{}\n", pc, I.A, I.B, fs.ir.callees[I.C]);
+			break;
+		case xCALLv:
+			fmt::print("{}: xcallv %{} {} @{}\n", pc, I.A, I.B, fs.ir.callees[I.C]);
+			break;
+		case xCALLi:
+			fmt::print("{}: xcalli %{} {} @{}\n", pc, I.A, I.B, fs.ir.callees[I.C]);
+			break;
+		case xCALLl:
+			fmt::print("{}: xcalll %{} {} @{}\n", pc, I.A, I.B, fs.ir.callees[I.C]);
+			break;
+		case xCALLd:
+			fmt::print("{}: xcalld %{} {} @{}\n", pc, I.A, I.B, fs.ir.callees[I.C]);
+			break;
+		case xCALLp:
+			fmt::print("{}: xcallp %{} {} @{}\n", pc, I.A, I.B, fs.ir.callees[I.C]);
+			break;
+		case xBATCH:
+			fmt::print("{}: xbatch %{} {} @{}\n", pc, I.A, I.B, fs.ir.callees[I.C]);
+			break;
+		case xFLUSH:
+			fmt::print("{}: xflush @{}\n", pc, fs.ir.callees[I.C]);
 			break;
 		case RET:
-			fmt::print("{}: ret: unimplemented\n", pc);
+			if (I.B > 1) {
+				fmt::print("{}: ret    %{} {}\n", pc, I.A, I.B);
+			} else if (I.B) {
+				fmt::print("{}: ret    %{}\n", pc, I.A);
+			} else {
+				fmt::print("{}: ret\n", pc);
+			}
+			break;
+		default:
+			fmt::print("{}: op {}\n", pc, int(I.op));
 			break;
 		}
-		pc++;
 	}
 	fmt::print("\n");
 }
 
 int main() {
 	Environment env {};
-	parse(env, R"(
+	auto module = compile(env, R"(
 		let a = 10
 		let b = 11
 		let c = (a + b) * (a - b * (b - a) / (a + b) + a + b)
@@ -139,5 +259,7 @@ int main() {
 		}
 	)");
 
+	VM vm;
+	vm.call(*module.main);
 	return 0;
 }
\ No newline at end of file
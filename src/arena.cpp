@@ -0,0 +1,121 @@
+#include "arena.hpp"
+
+#include <new>
+
+/* chunks let go of by recycling arenas, until the thread exits */
+struct ChunkCache {
+	static constexpr size_t MAX_CHUNKS = 256;
+
+	Arena::Chunk* head = nullptr;
+	size_t size = 0;
+
+	~ChunkCache() {
+		while (head != nullptr) {
+			auto next = head->next;
+			::operator delete(head);
+			head = next;
+		}
+	}
+};
+
+static thread_local ChunkCache cache;
+
+size_t arena_cached_chunks() {
+	return cache.size;
+}
+
+Arena::~Arena() {
+	while (large != nullptr) {
+		auto next = large->next;
+		::operator delete(large);
+		large = next;
+	}
+	while (first != nullptr) {
+		auto next = first->next;
+		release(first);
+		first = next;
+	}
+}
+
+Arena::Chunk* Arena::take_chunk() {
+	Chunk* chunk;
+	if (recycle && cache.head != nullptr) {
+		chunk = cache.head;
+		cache.head = chunk->next;
+		cache.size--;
+	} else {
+		chunk = static_cast<Chunk*>(::operator new(sizeof(Chunk) + CHUNK_SIZE));
+		chunk->size = CHUNK_SIZE;
+	}
+	chunk->next = nullptr;
+	reserved += CHUNK_SIZE;
+	chunks++;
+	return chunk;
+}
+
+void Arena::release(Chunk* chunk) {
+	reserved -= CHUNK_SIZE;
+	chunks--;
+	if (recycle && cache.size < ChunkCache::MAX_CHUNKS) {
+		chunk->next = cache.head;
+		cache.head = chunk;
+		cache.size++;
+	} else {
+		::operator delete(chunk);
+	}
+}
+
+char* Arena::refill(size_t size) {
+	char* ptr;
+	if (size > CHUNK_SIZE / 4) {
+		auto block = static_cast<Chunk*>(::operator new(sizeof(Chunk) + size));
+		block->next = large;
+		block->size = size;
+		large = block;
+		reserved += size;
+		ptr = block->data();
+	} else {
+		if (current != nullptr && current->next != nullptr) {
+			current = current->next;
+		} else {
+			auto chunk = take_chunk();
+			(current != nullptr ? current->next : first) = chunk;
+			current = chunk;
+		}
+		ptr = current->data();
+		cursor = ptr + size;
+		available = CHUNK_SIZE - size;
+	}
+	in_use += size;
+	allocated += size;
+	peak = in_use > peak ? in_use : peak;
+	return ptr;
+}
+
+void Arena::reset() {
+	while (large != nullptr) {
+		auto next = large->next;
+		reserved -= large->size;
+		::operator delete(large);
+		large = next;
+	}
+	/* a run that needed more than usual does not pin its memory for good */
+	if (chunks > MAX_RETAINED) {
+		auto last = first;
+		for (size_t i = 1; i < MAX_RETAINED; i++) {
+			last = last->next;
+		}
+		auto chunk = last->next;
+		last->next = nullptr;
+		while (chunk != nullptr) {
+			auto next = chunk->next;
+			release(chunk);
+			chunk = next;
+		}
+	}
+	current = first;
+	cursor = first != nullptr ? first->data() : nullptr;
+	available = first != nullptr ? CHUNK_SIZE : 0;
+	in_use = 0;
+	resets++;
+}
@@ -0,0 +1,439 @@
+#include "cache.hpp"
+#include "vm.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * File layout, in host byte order:
+ *
+ *   FileHeader
+ *   FunctionHeader[functions]
+ *   the constant pool, 8-byte aligned:
+ *     int64_t     constants[constants]	string bodies hold their offset in text
+ *     uint32_t    string constants[strings]
+ *     char        text[text_size]	NUL terminated strings
+ *   per function, 8-byte aligned at FunctionHeader::offset:
+ *     Instruction instructions[instructions]
+ *     uint32_t    callees[callees]
+ *     uint8_t     argument types[args]
+ *     char        name[name_size]
+ *     char        signature[signature_size]	host functions only
+ *
+ * Functions are stored in Environment order, so callees index the table.
+ * Host functions have no code, only their name and signature, which must
+ * match what the loading Environment declares at the same position.
+ */
+
+struct FileHeader {
+	char magic[4];
+	uint16_t version;
+	uint16_t opcodes;	/* NUM_OPCODES of the writer */
+	uint32_t instruction_size;
+	uint32_t functions;
+	uint32_t constants;
+	uint32_t strings;	/* how many of the constants are strings */
+	uint64_t text_size;
+};
+
+struct FunctionHeader {
+	uint64_t offset;
+	uint32_t name_size;
+	uint32_t stack_size;
+	uint32_t instructions;
+	uint32_t callees;
+	uint8_t return_type;
+	uint8_t args;
+	uint16_t signature_size;
+};
+
+static_assert(sizeof(FileHeader) == 32);
+static_assert(sizeof(FunctionHeader) == 32);
+
+static constexpr char MAGIC[4] = {'\x1b', 'L', 'b', 'c'};
+
+/* types are stored as their Type index, only the ones without payload can be */
+static int type_tag(const Type& type) {
+	if (std::holds_alternative<FunctionType*>(type) || std::holds_alternative<StructType*>(type)) {
+		return -1;
+	}
+	return int(type.index());
+}
+
+static Type tag_type(uint8_t tag) {
+	switch (tag) {
+	case 0: return VoidType{};
+	case 1: return BoolType{};
+	case 2: return IntType{};
+	case 3: return FloatType{};
+	default: return StringType{};
+	}
+}
+
+static bool is_valid_tag(uint8_t tag) {
+	return tag <= 4;
+}
+
+static uint64_t align8(uint64_t offset) {
+	return (offset + 7) & ~uint64_t(7);
+}
+
+static uint64_t pool_size(const FileHeader& h) {
+	return uint64_t(h.constants) * sizeof(int64_t)
+		+ uint64_t(h.strings) * sizeof(uint32_t)
+		+ h.text_size;
+}
+
+static uint64_t block_size(const FunctionHeader& h) {
+	return uint64_t(h.instructions) * sizeof(Instruction)
+		+ uint64_t(h.callees) * sizeof(uint32_t)
+		+ h.args
+		+ h.name_size
+		+ h.signature_size;
+}
+
+bool save_bytecode(const Environment& env, const char* path) {
+	FileHeader header{};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = BYTECODE_VERSION;
+	header.opcodes = NUM_OPCODES;
+	header.instruction_size = sizeof(Instruction);
+	header.functions = uint32_t(env.functions.size());
+
+	/* string constants are stored as offsets into the text */
+	auto pool = env.constants;
+	std::vector<uint32_t> strings;
+	std::string text;
+	for (auto const& [string, body] : env.strings) {
+		auto it = env.constant_index.find(reinterpret_cast<int64_t>(body));
+		if (it == env.constant_index.end()) {
+			continue;
+		}
+		pool[it->second] = int64_t(text.size());
+		strings.push_back(it->second);
+		text.append(string).push_back('\0');
+	}
+	header.constants = uint32_t(pool.size());
+	header.strings = uint32_t(strings.size());
+	header.text_size = text.size();
+
+	std::vector<FunctionHeader> table;
+	auto pool_offset = align8(sizeof(FileHeader) + env.functions.size() * sizeof(FunctionHeader));
+	auto offset = align8(pool_offset + pool_size(header));
+	for (auto const& fn : env.functions) {
+		if (fn.type == nullptr || type_tag(fn.type->return_type) < 0 || fn.type->args.size() > UINT8_MAX) {
+			return false;
+		}
+		for (auto const& arg : fn.type->args) {
+			if (type_tag(arg) < 0) {
+				return false;
+			}
+		}
+
+		auto& h = table.emplace_back();
+		h.offset = offset;
+		h.name_size = uint32_t(fn.name.size());
+		h.stack_size = uint32_t(fn.stack_size);
+		h.instructions = uint32_t(fn.ir.instructions.size());
+		h.callees = uint32_t(fn.ir.callees.size());
+		h.return_type = uint8_t(type_tag(fn.type->return_type));
+		h.args = uint8_t(fn.type->args.size());
+		h.signature_size = fn.signature ? uint16_t(fn.signature->code.size()) : 0;
+		offset = align8(offset + block_size(h));
+	}
+
+	/* written aside and renamed over 'path', so readers never map a partial file */
+	auto temp = std::string(path) + ".tmp";
+	auto file = std::fopen(temp.c_str(), "wb");
+	if (file == nullptr) {
+		return false;
+	}
+
+	uint64_t written = 0;
+	auto write = [&](const void* data, size_t size) {
+		if (size != 0) {
+			written += std::fwrite(data, 1, size, file);
+		}
+	};
+	auto pad = [&](uint64_t to) {
+		static constexpr char zeros[8] = {};
+		write(zeros, to - written);
+	};
+
+	write(&header, sizeof(header));
+	write(table.data(), table.size() * sizeof(FunctionHeader));
+	pad(pool_offset);
+	write(pool.data(), pool.size() * sizeof(int64_t));
+	write(strings.data(), strings.size() * sizeof(uint32_t));
+	write(text.data(), text.size());
+	for (size_t i = 0; i < table.size(); i++) {
+		auto const& fn = env.functions[i];
+		pad(table[i].offset);
+		write(fn.ir.instructions.data(), fn.ir.instructions.size() * sizeof(Instruction));
+		write(fn.ir.callees.data(), fn.ir.callees.size() * sizeof(uint32_t));
+		for (auto const& arg : fn.type->args) {
+			auto tag = uint8_t(type_tag(arg));
+			write(&tag, 1);
+		}
+		write(fn.name.data(), fn.name.size());
+		if (fn.signature) {
+			write(fn.signature->code.data(), fn.signature->code.size());
+		}
+	}
+	pad(offset);
+
+	auto ok = written == offset;
+	ok = std::fclose(file) == 0 && ok;
+	if (!ok || std::rename(temp.c_str(), path) != 0) {
+		std::remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+/* a function's arrays inside the mapping */
+struct FunctionBlock {
+	const FunctionHeader* header;
+	BytecodeView ir;
+	const uint8_t* args;
+	std::string_view name;
+	std::string_view signature;
+};
+
+/* checks everything link() and the interpreter trust the compiler for */
+static bool verify(const FunctionBlock& block, uint32_t functions, size_t constants, const Environment& env) {
+	auto natives = env.functions.size();
+	auto const& code = block.ir.instructions;
+	if (code.empty()) {
+		return false;
+	}
+	if (block.header->stack_size > FuncState::MAX_REGISTERS || frame_size(code) > block.header->stack_size) {
+		return false;
+	}
+	for (auto callee : block.ir.callees) {
+		if (callee >= functions) {
+			return false;
+		}
+	}
+
+	auto is_jump = [](uint8_t op) {
+		return op == JMP || (op >= JE && op <= JGE);
+	};
+	for (size_t pc = 0; pc < code.size(); pc++) {
+		if (code[pc].op >= NUM_OPCODES) {
+			return false;
+		}
+		/* a WIDE word belongs to the instruction after it, which is never a jump or a jump target */
+		if (code[pc].op == WIDE) {
+			if (pc + 1 >= code.size() || code[pc + 1].op == WIDE || is_jump(code[pc + 1].op)) {
+				return false;
+			}
+			continue;
+		}
+		auto I = decode(code, pc);
+		if (is_jump(I.op)) {
+			if (I.sAx < 0 || size_t(I.sAx) >= code.size() || (I.sAx > 0 && code[I.sAx - 1].op == WIDE)) {
+				return false;
+			}
+		} else if (I.op >= BEQ && I.op <= BNZ) {
+			if (pc + 1 >= code.size() || code[pc + 1].op != JMP) {
+				return false;
+			}
+		} else if (I.op == LOADK) {
+			if (I.Bx >= constants) {
+				return false;
+			}
+		} else if (I.op == CALL || I.op == TAILCALL || (I.op >= xCALLv && I.op <= xFLUSH)) {
+			if (I.C >= block.ir.callees.size() || (block.ir.callees[I.C] < natives) != (I.op >= xCALLv)) {
+				return false;
+			}
+			if (I.op < xCALLv) {
+				continue;
+			}
+			/* host calls and batch records take as many registers as the signature has arguments */
+			auto const& callee = env.functions[block.ir.callees[I.C]];
+			if ((callee.batch_capacity != 0) != (I.op >= xBATCH)) {
+				return false;
+			}
+			if (I.op <= xBATCH && I.B != callee.signature->args().size()) {
+				return false;
+			}
+			if (I.op == xFLUSH && (I.A != 0 || I.B != 0)) {
+				return false;
+			}
+		}
+	}
+	/* every path ends in RET or TAILCALL */
+	return !falls_through(code);
+}
+
+static bool read_functions(Environment& env, const char* data, size_t size) {
+	if (size < sizeof(FileHeader)) {
+		return false;
+	}
+	auto header = reinterpret_cast<const FileHeader*>(data);
+	if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+		|| header->version != BYTECODE_VERSION
+		|| header->opcodes != NUM_OPCODES
+		|| header->instruction_size != sizeof(Instruction)) {
+		return false;
+	}
+	if (header->functions > (size - sizeof(FileHeader)) / sizeof(FunctionHeader)) {
+		return false;
+	}
+
+	auto pool_offset = align8(sizeof(FileHeader) + header->functions * sizeof(FunctionHeader));
+	if (pool_offset > size || header->text_size > size || pool_size(*header) > size - pool_offset) {
+		return false;
+	}
+	auto pool = reinterpret_cast<const int64_t*>(data + pool_offset);
+	std::vector<int64_t> constants(pool, pool + header->constants);
+	auto string_constants = reinterpret_cast<const uint32_t*>(pool + header->constants);
+	auto text = std::string_view(reinterpret_cast<const char*>(string_constants + header->strings), header->text_size);
+
+	/* each string is a distinct NUL terminated piece of the text, too long to be inline */
+	std::vector<std::pair<std::string_view, uint32_t>> strings;
+	std::vector<bool> is_string(constants.size());
+	std::unordered_set<std::string_view> texts;
+	for (uint32_t i = 0; i < header->strings; i++) {
+		auto k = string_constants[i];
+		if (k >= constants.size() || is_string[k] || uint64_t(constants[k]) >= text.size()) {
+			return false;
+		}
+		auto end = text.find('\0', size_t(constants[k]));
+		if (end == std::string_view::npos) {
+			return false;
+		}
+		auto string = text.substr(size_t(constants[k]), end - size_t(constants[k]));
+		if (string.size() <= MAX_INLINE_STRING || !texts.insert(string).second) {
+			return false;
+		}
+		is_string[k] = true;
+		strings.emplace_back(string, k);
+	}
+
+	auto table = reinterpret_cast<const FunctionHeader*>(data + sizeof(FileHeader));
+	auto natives = env.functions.size();
+	std::vector<FunctionBlock> blocks;
+	blocks.reserve(header->functions);
+	for (uint32_t i = 0; i < header->functions; i++) {
+		auto const& h = table[i];
+		if (h.offset % 8 != 0 || h.offset > size || block_size(h) > size - h.offset) {
+			return false;
+		}
+
+		auto p = data + h.offset;
+		auto& block = blocks.emplace_back();
+		block.header = &h;
+		block.ir.instructions = {reinterpret_cast<const Instruction*>(p), h.instructions};
+		p += h.instructions * sizeof(Instruction);
+		block.ir.callees = {reinterpret_cast<const uint32_t*>(p), h.callees};
+		p += h.callees * sizeof(uint32_t);
+		block.args = reinterpret_cast<const uint8_t*>(p);
+		p += h.args;
+		block.name = {p, h.name_size};
+		p += h.name_size;
+		block.signature = {p, h.signature_size};
+
+		if (block.name.empty() || !is_valid_tag(h.return_type)) {
+			return false;
+		}
+		if (block.signature.empty() ? !verify(block, header->functions, constants.size(), env) : h.instructions != 0) {
+			return false;
+		}
+		for (uint8_t a = 0; a < h.args; a++) {
+			if (!is_valid_tag(block.args[a])) {
+				return false;
+			}
+		}
+	}
+
+	/* the host functions come first and are already declared */
+	if (blocks.size() < natives) {
+		return false;
+	}
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (blocks[i].signature.empty() != (i >= natives)) {
+			return false;
+		}
+		if (i < natives) {
+			auto const& fn = env.functions[i];
+			if (fn.name != blocks[i].name || fn.signature == nullptr || fn.signature->code != blocks[i].signature) {
+				return false;
+			}
+		}
+	}
+
+	/* every function must exist before any CALL can point at it */
+	auto types = env.types.size();
+	for (size_t i = natives; i < blocks.size(); i++) {
+		auto const& block = blocks[i];
+		if (env.function(block.name) != i) {
+			for (size_t j = natives; j < env.functions.size(); j++) {
+				env.function_index.erase(env.functions[j].name);
+			}
+			env.functions.resize(natives);
+			env.types.resize(types);
+			return false;
+		}
+		auto& fn = env.functions.back();
+		fn.type = env.function_type(tag_type(block.header->return_type));
+		for (uint8_t a = 0; a < block.header->args; a++) {
+			fn.type->args.push_back(tag_type(block.args[a]));
+		}
+		fn.defined = true;
+		fn.stack_size = int(block.header->stack_size);
+	}
+
+	for (auto const& [string, k] : strings) {
+		constants[k] = env.string(string);
+	}
+	for (size_t k = 0; k < constants.size(); k++) {
+		env.constant_index.emplace(constants[k], uint32_t(k));
+	}
+	env.constants = std::move(constants);
+
+	for (size_t i = natives; i < blocks.size(); i++) {
+		link(env.functions[i], blocks[i].ir, env);
+	}
+	return true;
+}
+
+bool load_bytecode(Environment& env, const char* path) {
+	for (auto const& fn : env.functions) {
+		if (fn.native == nullptr) {
+			return false;
+		}
+	}
+	if (!env.constants.empty()) {
+		return false;
+	}
+
+	auto fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st{};
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	auto size = size_t(st.st_size);
+	auto map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	/* linked code keeps nothing from the file, so the mapping goes away right after */
+	auto ok = read_functions(env, static_cast<const char*>(map), size);
+	munmap(map, size);
+	return ok;
+}
@@ -0,0 +1,771 @@
+#include "codegen.hpp"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+/*
+ * Peephole pass over the packed instruction stream. It works on pairs of
+ * adjacent instructions and relies on a backward liveness analysis over
+ * registers (plus the comparison flags) to prove that the temporary
+ * connecting the pair is dead afterwards:
+ *
+ *   load   t v;  op ... t ...   ->  op ... v ...
+ *   op t ...;    load x t       ->  op x ...
+ *   istore t k;  op  a b t      ->  opk  a b k
+ *   istore t k;  icmp a t       ->  icmpk a k
+ *   icmp   a b;  jlt L          ->  blt a b; jmp L
+ *   test   a;    je L           ->  bz a; jmp L
+ *
+ * The JMP left behind a fused branch only carries the target, link()
+ * folds both words into a single dispatched instruction.
+ *
+ * The pass runs on decoded instructions, so WIDE words only come back when
+ * the result is encoded again.
+ */
+
+struct Effect {
+	int def = -1;
+	int uses[3] = {-1, -1, -1};
+	int uses_count = 0;	/* registers read from uses[0] up */
+	bool reads_flags = false;
+	bool writes_flags = false;
+};
+
+static bool is_conditional_jump(uint8_t op) {
+	return op >= JE && op <= JGE;
+}
+
+static bool is_jump(uint8_t op) {
+	return op == JMP || is_conditional_jump(op);
+}
+
+static bool is_branch(uint8_t op) {
+	return op >= BEQ && op <= BNZ;
+}
+
+static bool fits_sC(int32_t value) {
+	return value >= -128 && value <= 127;
+}
+
+enum OpMode { iABC, iABx, iAsBx, isAx };
+
+static OpMode mode(uint8_t op) {
+	switch (op) {
+	case LOADK:
+		return iABx;
+	case ISTORE:
+	case ICMPK:
+	case BEQK:
+	case BNEK:
+	case BLTK:
+	case BLEK:
+	case BGTK:
+	case BGEK:
+		return iAsBx;
+	case JMP:
+	case JE:
+	case JNE:
+	case JLT:
+	case JLE:
+	case JGT:
+	case JGE:
+		return isAx;
+	default:
+		return iABC;
+	}
+}
+
+static bool has_sC(uint8_t op) {
+	return op >= IADDK && op <= IMODK;
+}
+
+/* jump targets are instruction positions, the encoding leaves 24 bits for them */
+static constexpr size_t MAX_CODE = size_t(1) << 23;
+
+WideInstruction decode(std::span<const Instruction> code, size_t pc) {
+	auto const& I = code[pc];
+	WideInstruction W{};
+	W.op = I.op;
+
+	if (pc == 0 || code[pc - 1].op != WIDE) {
+		switch (mode(I.op)) {
+		case iABC:
+			W.A = I.A;
+			W.B = I.B;
+			if (has_sC(I.op)) W.sC = I.sC; else W.C = I.C;
+			break;
+		case iABx:
+			W.A = I.A;
+			W.Bx = I.Bx;
+			break;
+		case iAsBx:
+			W.A = I.A;
+			W.sBx = I.sBx;
+			break;
+		case isAx:
+			W.sAx = I.sAx;
+			break;
+		}
+		return W;
+	}
+
+	/* the high part keeps the sign, the low part is taken as is */
+	auto const& P = code[pc - 1];
+	switch (mode(I.op)) {
+	case iABC:
+		W.A = P.A << 8 | I.A;
+		W.B = P.B << 8 | I.B;
+		if (has_sC(I.op)) W.sC = P.sC * 256 + int32_t(I.C); else W.C = P.C << 8 | I.C;
+		break;
+	case iABx:
+		W.A = P.A << 8 | I.A;
+		W.Bx = P.Bx << 16 | I.Bx;
+		break;
+	case iAsBx:
+		W.A = P.A << 8 | I.A;
+		W.sBx = int32_t(uint32_t(P.sBx) << 16 | I.Bx);
+		break;
+	case isAx:
+		W.sAx = I.sAx;
+		break;
+	}
+	return W;
+}
+
+static bool fits(int64_t value, int bits) {
+	return value >= -(int64_t(1) << (bits - 1)) && value < (int64_t(1) << (bits - 1));
+}
+
+/* splits 'I' into its narrow word and the WIDE word in front of it, false if it needs none */
+static bool split(const WideInstruction& I, Instruction& narrow, Instruction& prefix) {
+	narrow = {};
+	prefix = {};
+	narrow.op = I.op;
+	prefix.op = WIDE;
+
+	bool wide = false;
+	auto check = [](bool ok) {
+		if (!ok) {
+			fmt::print("operand out of range\n");
+			abort();
+		}
+	};
+	switch (mode(I.op)) {
+	case iABC:
+		check(I.A <= UINT16_MAX && I.B <= UINT16_MAX);
+		check(has_sC(I.op) ? fits(I.sC, 16) : I.C <= UINT16_MAX);
+		wide = I.A > UINT8_MAX || I.B > UINT8_MAX || (has_sC(I.op) ? !fits(I.sC, 8) : I.C > UINT8_MAX);
+		narrow.A = I.A;
+		narrow.B = I.B;
+		narrow.C = I.C;
+		if (wide) {
+			prefix.A = I.A >> 8;
+			prefix.B = I.B >> 8;
+			prefix.C = has_sC(I.op) ? uint32_t(I.sC >> 8) : I.C >> 8;
+		}
+		break;
+	case iABx:
+	case iAsBx:
+		check(I.A <= UINT16_MAX);
+		wide = I.A > UINT8_MAX || (mode(I.op) == iABx ? I.Bx > UINT16_MAX : !fits(I.sBx, 16));
+		narrow.A = I.A;
+		narrow.Bx = I.Bx;
+		if (wide) {
+			prefix.A = I.A >> 8;
+			prefix.Bx = mode(I.op) == iABx ? I.Bx >> 16 : uint32_t(I.sBx >> 16);
+		}
+		break;
+	case isAx:
+		check(I.sAx >= 0 && size_t(I.sAx) < MAX_CODE);
+		narrow.sAx = I.sAx;
+		break;
+	}
+	return wide;
+}
+
+size_t Bytecode::emit(const WideInstruction& I) {
+	if (instructions.size() + 2 > MAX_CODE) {
+		fmt::print("function needs more than {} instructions\n", MAX_CODE);
+		abort();
+	}
+	Instruction narrow, prefix;
+	if (split(I, narrow, prefix)) {
+		instructions.push_back(prefix);
+	}
+	instructions.push_back(narrow);
+	return instructions.size() - 1;
+}
+
+static Effect effect(const WideInstruction& I) {
+	Effect e{};
+	switch (I.op) {
+	case NOP:
+	case JMP:
+		break;
+	case RET:
+		e.uses[0] = I.B ? int(I.A) : -1;
+		e.uses_count = I.B;
+		break;
+	case CALL:
+	case TAILCALL:
+		/* the callee runs on the same flags and reads its arguments in place */
+		e.def = I.A;
+		e.uses[0] = I.B ? int(I.A) : -1;
+		e.uses_count = I.B;
+		e.writes_flags = true;
+		break;
+	case xFLUSH:
+		break;
+	case xCALLv:
+	case xBATCH:
+		e.uses[0] = I.B ? int(I.A) : -1;
+		e.uses_count = I.B;
+		break;
+	case xCALLi:
+	case xCALLl:
+	case xCALLd:
+	case xCALLp:
+		e.def = I.A;
+		e.uses[0] = I.B ? int(I.A) : -1;
+		e.uses_count = I.B;
+		break;
+	case LOAD:
+		e.def = I.A;
+		e.uses[0] = I.B;
+		break;
+	case ISTORE:
+	case LOADK:
+		e.def = I.A;
+		break;
+	case IADD:
+	case ISUB:
+	case IMUL:
+	case IDIV:
+	case IMOD:
+	case FADD:
+	case FSUB:
+	case FMUL:
+	case FDIV:
+		e.def = I.A;
+		e.uses[0] = I.B;
+		e.uses[1] = I.C;
+		break;
+	case INEG:
+	case FNEG:
+	case NOT:
+	case SLEN:
+		e.def = I.A;
+		e.uses[0] = I.B;
+		break;
+	case CONCAT:
+		e.def = I.A;
+		e.uses[0] = I.B;
+		e.uses[1] = I.C;
+		break;
+	case NEWSTRUCT:
+		e.def = I.A;
+		break;
+	case GETFIELD:
+	case FIELDPTR:
+		e.def = I.A;
+		e.uses[0] = I.B;
+		break;
+	case SETFIELD:
+		e.uses[0] = I.A;
+		e.uses[1] = I.C;
+		break;
+	case SCOPY:
+		e.uses[0] = I.A;
+		e.uses[1] = I.B;
+		break;
+	case IADDK:
+	case ISUBK:
+	case IMULK:
+	case IDIVK:
+	case IMODK:
+		e.def = I.A;
+		e.uses[0] = I.B;
+		break;
+	case ICMP:
+	case FCMP:
+	case SEQ:
+	case SCMP:
+		e.uses[0] = I.A;
+		e.uses[1] = I.B;
+		e.writes_flags = true;
+		break;
+	case ICMPK:
+	case TEST:
+		e.uses[0] = I.A;
+		e.writes_flags = true;
+		break;
+	case JE:
+	case JNE:
+	case JLT:
+	case JLE:
+	case JGT:
+	case JGE:
+		e.reads_flags = true;
+		break;
+	case BEQ:
+	case BNE:
+	case BLT:
+	case BLE:
+	case BGT:
+	case BGE:
+		e.uses[0] = I.A;
+		e.uses[1] = I.B;
+		break;
+	case BEQK:
+	case BNEK:
+	case BLTK:
+	case BLEK:
+	case BGTK:
+	case BGEK:
+	case BZ:
+	case BNZ:
+		e.uses[0] = I.A;
+		break;
+	default:
+		e.uses[0] = I.A;
+		e.uses[1] = I.B;
+		e.uses[2] = I.C;
+		e.reads_flags = true;
+		break;
+	}
+	return e;
+}
+
+/* calls 'fn' with every position control may go to after 'pc', code.size() when it runs off the end */
+template <typename Fn>
+static void successors(const std::vector<WideInstruction>& code, size_t pc, Fn&& fn) {
+	auto const& I = code[pc];
+	if (is_branch(I.op)) {
+		fn(pc + 2);
+		fn(code[pc + 1].sAx);
+	} else if (I.op == JMP) {
+		fn(I.sAx);
+	} else if (is_conditional_jump(I.op)) {
+		fn(pc + 1);
+		fn(I.sAx);
+	} else if (I.op != RET && I.op != TAILCALL) {
+		fn(pc + 1);
+	}
+}
+
+/*
+ * Register sets hold one bit per register and one more for the flags. The
+ * sets of all instructions share one array, 'words' 64-bit words each.
+ */
+static void set_bit(uint64_t* set, size_t i, bool value) {
+	auto bit = uint64_t(1) << (i % 64);
+	set[i / 64] = value ? set[i / 64] | bit : set[i / 64] & ~bit;
+}
+
+struct Liveness {
+	size_t flags;
+	size_t words;
+	std::vector<uint64_t> live_out;
+	std::vector<bool> is_target;
+
+	Liveness(const std::vector<WideInstruction>& code, size_t registers)
+		: flags(registers)
+		, words(registers / 64 + 1)
+		, live_out(code.size() * words)
+		, is_target(code.size() + 1) {
+		std::vector<uint64_t> live_in(code.size() * words);
+		std::vector<uint64_t> out(words), in(words);
+
+		for (auto const& I : code) {
+			if (is_jump(I.op)) {
+				is_target[I.sAx] = true;
+			}
+		}
+
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			for (size_t pc = code.size(); pc-- > 0;) {
+				auto const& I = code[pc];
+
+				std::fill(out.begin(), out.end(), 0);
+				successors(code, pc, [&](size_t succ) {
+					if (succ < code.size()) {
+						for (size_t w = 0; w < words; w++) {
+							out[w] |= live_in[succ * words + w];
+						}
+					}
+				});
+
+				auto e = effect(I);
+				in = out;
+				if (e.def >= 0) {
+					set_bit(in.data(), e.def, false);
+				}
+				if (e.writes_flags) {
+					set_bit(in.data(), flags, false);
+				}
+				for (auto use : e.uses) {
+					if (use >= 0) {
+						set_bit(in.data(), use, true);
+					}
+				}
+				for (int r = 1; r < e.uses_count; r++) {
+					set_bit(in.data(), e.uses[0] + r, true);
+				}
+				if (e.reads_flags) {
+					set_bit(in.data(), flags, true);
+				}
+
+				auto old_out = live_out.begin() + pc * words;
+				auto old_in = live_in.begin() + pc * words;
+				if (!std::equal(out.begin(), out.end(), old_out) || !std::equal(in.begin(), in.end(), old_in)) {
+					std::copy(out.begin(), out.end(), old_out);
+					std::copy(in.begin(), in.end(), old_in);
+					changed = true;
+				}
+			}
+		}
+	}
+
+	/* true if 'reg' may be read after 'pc' executes */
+	bool live_after(size_t pc, size_t reg) const {
+		return live_out[pc * words + reg / 64] >> (reg % 64) & 1;
+	}
+
+	/* true if the value 'reg' holds before 'pc' executes is not observed after it */
+	bool dies_at(const WideInstruction& I, size_t pc, int reg) const {
+		return effect(I).def == reg || !live_after(pc, reg);
+	}
+};
+
+/* instructions whose only effect is writing register A */
+static bool is_pure_def(uint8_t op) {
+	switch (op) {
+	case LOAD:
+	case ISTORE:
+	case LOADK:
+	case IADD:
+	case ISUB:
+	case IMUL:
+	case IDIV:
+	case IMOD:
+	case INEG:
+	case FADD:
+	case FSUB:
+	case FMUL:
+	case FDIV:
+	case FNEG:
+	case NOT:
+	case CONCAT:
+	case SLEN:
+	case NEWSTRUCT:
+	case GETFIELD:
+	case FIELDPTR:
+	case IADDK:
+	case ISUBK:
+	case IMULK:
+	case IDIVK:
+	case IMODK:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* replaces register operands read by 'I' that equal 'from' with 'to' */
+static bool forward(WideInstruction& I, uint32_t from, uint32_t to) {
+	switch (I.op) {
+	case LOAD:
+	case INEG:
+	case FNEG:
+	case NOT:
+	case SLEN:
+	case GETFIELD:
+	case FIELDPTR:
+	case IADDK:
+	case ISUBK:
+	case IMULK:
+	case IDIVK:
+	case IMODK:
+		if (I.B != from) {
+			return false;
+		}
+		I.B = to;
+		return true;
+	case IADD:
+	case ISUB:
+	case IMUL:
+	case IDIV:
+	case IMOD:
+	case FADD:
+	case FSUB:
+	case FMUL:
+	case FDIV:
+	case CONCAT:
+		if (I.B != from && I.C != from) {
+			return false;
+		}
+		if (I.B == from) I.B = to;
+		if (I.C == from) I.C = to;
+		return true;
+	case ICMP:
+	case FCMP:
+	case SEQ:
+	case SCMP:
+		if (I.A != from && I.B != from) {
+			return false;
+		}
+		if (I.A == from) I.A = to;
+		if (I.B == from) I.B = to;
+		return true;
+	case ICMPK:
+	case TEST:
+		if (I.A != from) {
+			return false;
+		}
+		I.A = to;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* folds 'istore t k' into the instruction that consumes t */
+static bool fold_immediate(WideInstruction& I, uint32_t t, int32_t k) {
+	switch (I.op) {
+	case LOAD:
+		if (I.B != t) {
+			return false;
+		}
+		I.op = ISTORE;
+		I.sBx = k;
+		return true;
+	case IADD:
+	case IMUL:
+		if (I.B == t && I.C != t && fits_sC(k)) {
+			I.B = I.C;
+		} else if (I.C != t || I.B == t || !fits_sC(k)) {
+			return false;
+		}
+		I.op = I.op == IADD ? IADDK : IMULK;
+		I.sC = k;
+		return true;
+	case ISUB:
+	case IDIV:
+	case IMOD:
+		if (I.C != t || I.B == t || !fits_sC(k)) {
+			return false;
+		}
+		I.op = I.op - ISUB + ISUBK;
+		I.sC = k;
+		return true;
+	case ICMP:
+		if (I.B != t || I.A == t) {
+			return false;
+		}
+		I.op = ICMPK;
+		I.sBx = k;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static OPCODE fuse_branch(uint8_t cmp, uint8_t jump) {
+	switch (cmp) {
+	case ICMP:
+		return OPCODE(BEQ + (jump - JE));
+	case ICMPK:
+		return OPCODE(BEQK + (jump - JE));
+	case TEST:
+		if (jump == JE) return BZ;
+		if (jump == JNE) return BNZ;
+		return NOP;
+	default:
+		return NOP;
+	}
+}
+
+static void compact(std::vector<WideInstruction>& code, const std::vector<bool>& removed) {
+	std::vector<uint32_t> remap(code.size() + 1);
+
+	size_t count = 0;
+	for (size_t pc = 0; pc < code.size(); pc++) {
+		remap[pc] = count;
+		if (!removed[pc]) {
+			code[count++] = code[pc];
+		}
+	}
+	remap[code.size()] = count;
+	code.resize(count);
+
+	for (auto& I : code) {
+		if (is_jump(I.op)) {
+			I.sAx = remap[I.sAx];
+		}
+	}
+}
+
+/* decoded code, jumps pointing at decoded positions */
+static std::vector<WideInstruction> unpack(std::span<const Instruction> words) {
+	std::vector<WideInstruction> code;
+	std::vector<uint32_t> remap(words.size() + 1);
+	for (size_t pc = 0; pc < words.size(); pc++) {
+		remap[pc] = code.size();
+		if (words[pc].op != WIDE) {
+			code.push_back(decode(words, pc));
+		}
+	}
+	remap[words.size()] = code.size();
+
+	for (auto& I : code) {
+		if (is_jump(I.op)) {
+			I.sAx = remap[I.sAx];
+		}
+	}
+	return code;
+}
+
+/* encodes 'code' back into 'ir', moving jump targets past the WIDE words */
+static void pack(std::vector<WideInstruction>& code, Bytecode& ir) {
+	std::vector<uint32_t> remap(code.size() + 1);
+	size_t count = 0;
+	for (size_t pc = 0; pc < code.size(); pc++) {
+		Instruction narrow, prefix;
+		remap[pc] = count;
+		count += split(code[pc], narrow, prefix) ? 2 : 1;
+	}
+	remap[code.size()] = count;
+
+	ir.instructions.clear();
+	for (auto& I : code) {
+		if (is_jump(I.op)) {
+			I.sAx = remap[I.sAx];
+		}
+		ir.emit(I);
+	}
+}
+
+size_t frame_size(std::span<const Instruction> code) {
+	size_t size = 0;
+	for (size_t pc = 0; pc < code.size(); pc++) {
+		if (code[pc].op == WIDE) {
+			continue;
+		}
+		auto e = effect(decode(code, pc));
+		size = std::max<size_t>(size, e.def + 1);
+		for (auto use : e.uses) {
+			size = std::max<size_t>(size, use + 1);
+		}
+		if (e.uses_count > 0) {
+			size = std::max<size_t>(size, e.uses[0] + e.uses_count);
+		}
+	}
+	return size;
+}
+
+bool falls_through(std::span<const Instruction> words) {
+	auto code = unpack(words);
+	std::vector<bool> reached(code.size() + 1);
+	std::vector<size_t> pending{0};
+	while (!pending.empty()) {
+		auto pc = pending.back();
+		pending.pop_back();
+		if (reached[pc]) {
+			continue;
+		}
+		reached[pc] = true;
+		if (pc < code.size()) {
+			successors(code, pc, [&](size_t succ) {
+				pending.push_back(succ);
+			});
+		}
+	}
+	return reached[code.size()];
+}
+
+size_t Bytecode::optimize(size_t registers) {
+	auto code = unpack(instructions);
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+
+		Liveness liveness{code, registers};
+		std::vector<bool> removed(code.size());
+
+		for (size_t pc = 0; pc < code.size(); pc++) {
+			if (code[pc].op == LOAD && code[pc].A == code[pc].B) {
+				removed[pc] = true;
+				changed = true;
+			}
+		}
+
+		for (size_t pc = 0; pc + 1 < code.size(); pc++) {
+			if (removed[pc] || removed[pc + 1]) {
+				continue;
+			}
+			auto const& I = code[pc];
+			auto& next = code[pc + 1];
+			if (liveness.is_target[pc + 1]) {
+				continue;
+			}
+
+			if (next.op == LOAD && next.B == I.A && next.A != I.A && is_pure_def(I.op) && !liveness.live_after(pc + 1, I.A)) {
+				code[pc].A = next.A;
+				removed[pc + 1] = true;
+				changed = true;
+				pc++;
+				continue;
+			}
+
+			if (I.op != LOAD && I.op != ISTORE) {
+				continue;
+			}
+			if (!liveness.dies_at(next, pc + 1, I.A)) {
+				continue;
+			}
+
+			auto candidate = next;
+			bool folded = I.op == LOAD
+				? I.A != I.B && forward(candidate, I.A, I.B)
+				: fold_immediate(candidate, I.A, I.sBx);
+			if (folded) {
+				next = candidate;
+				removed[pc] = true;
+				changed = true;
+				pc++;
+			}
+		}
+
+		if (changed) {
+			compact(code, removed);
+		}
+	}
+
+	Liveness liveness{code, registers};
+	for (size_t pc = 0; pc + 1 < code.size(); pc++) {
+		auto& I = code[pc];
+		auto& next = code[pc + 1];
+		if (!is_conditional_jump(next.op) || liveness.is_target[pc + 1]) {
+			continue;
+		}
+		if (!liveness.dies_at(next, pc + 1, liveness.flags)) {
+			continue;
+		}
+		auto fused = fuse_branch(I.op, next.op);
+		if (fused == NOP) {
+			continue;
+		}
+		I.op = fused;
+		next.op = JMP;
+		pc++;
+	}
+
+	pack(code, *this);
+	return frame_size(instructions);
+}
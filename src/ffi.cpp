@@ -0,0 +1,136 @@
+#include "ffi.hpp"
+#include "vm.hpp"
+
+#include <array>
+#include <utility>
+
+template <class T>
+static T argument(const Value& value) {
+	if constexpr (std::is_same_v<T, double>) {
+		return value.f64;
+	} else if constexpr (std::is_pointer_v<T>) {
+		return value.p;
+	} else {
+		return value.i64;
+	}
+}
+
+template <class R, class... Args, size_t... I>
+static Value invoke(void* fn, const Value* args, std::index_sequence<I...>) {
+	auto f = reinterpret_cast<R (*)(Args...)>(fn);
+	Value result{};
+	if constexpr (std::is_void_v<R>) {
+		f(argument<Args>(args[I])...);
+	} else if constexpr (std::is_same_v<R, double>) {
+		result.f64 = f(argument<Args>(args[I])...);
+	} else if constexpr (std::is_pointer_v<R>) {
+		result.p = f(argument<Args>(args[I])...);
+	} else {
+		result.i64 = f(argument<Args>(args[I])...);
+	}
+	return result;
+}
+
+template <class R, class... Args>
+static Value trampoline(void* fn, const Value* args) {
+	return invoke<R, Args...>(fn, args, std::index_sequence_for<Args...>{});
+}
+
+/*
+ * Trampolines form a tree by argument list, one tree per return type: the
+ * children of entry k take one more argument than it, an int64_t, a double
+ * or a pointer, at 3k+1, 3k+2 and 3k+3. An int argument shares the int64_t
+ * entry.
+ */
+static constexpr size_t tree_size(size_t depth) {
+	return depth == 0 ? 1 : 1 + 3 * tree_size(depth - 1);
+}
+
+using TrampolineTable = std::array<Trampoline, tree_size(Signature::MAX_TRAMPOLINE_ARGS)>;
+
+template <size_t depth, class R, class... Args>
+static constexpr void fill(TrampolineTable& table, size_t k) {
+	table[k] = &trampoline<R, Args...>;
+	if constexpr (depth < Signature::MAX_TRAMPOLINE_ARGS) {
+		fill<depth + 1, R, Args..., int64_t>(table, 3 * k + 1);
+		fill<depth + 1, R, Args..., double>(table, 3 * k + 2);
+		fill<depth + 1, R, Args..., void*>(table, 3 * k + 3);
+	}
+}
+
+template <class R>
+static constexpr TrampolineTable make_table() {
+	TrampolineTable table{};
+	fill<0, R>(table, 0);
+	return table;
+}
+
+static constexpr TrampolineTable void_trampolines = make_table<void>();
+static constexpr TrampolineTable int_trampolines = make_table<int>();
+static constexpr TrampolineTable int64_trampolines = make_table<int64_t>();
+static constexpr TrampolineTable double_trampolines = make_table<double>();
+static constexpr TrampolineTable pointer_trampolines = make_table<void*>();
+
+static Trampoline find_trampoline(std::string_view args, char ret) {
+	if (args.size() > Signature::MAX_TRAMPOLINE_ARGS) {
+		return nullptr;
+	}
+	size_t k = 0;
+	for (auto c : args) {
+		switch (c) {
+		case 'l': k = 3 * k + 1; break;
+		/* on 64-bit targets an int takes the register or stack slot an int64_t would, the callee reads the low half */
+		case 'i':
+			if (sizeof(void*) != sizeof(int64_t)) {
+				return nullptr;
+			}
+			k = 3 * k + 1;
+			break;
+		case 'd': k = 3 * k + 2; break;
+		case 'p': k = 3 * k + 3; break;
+		default: return nullptr;
+		}
+	}
+	switch (ret) {
+	case 'v': return void_trampolines[k];
+	case 'i': return int_trampolines[k];
+	case 'l': return int64_trampolines[k];
+	case 'd': return double_trampolines[k];
+	default: return pointer_trampolines[k];
+	}
+}
+
+bool parse_signature(Signature& signature, std::string_view code) {
+	if (code.size() < 2 || code[code.size() - 2] != ')') {
+		return false;
+	}
+	for (auto c : code.substr(0, code.size() - 2)) {
+		if (std::string_view("Bcsijlfdp").find(c) == std::string_view::npos) {
+			return false;
+		}
+	}
+	if (std::string_view("vildp").find(code.back()) == std::string_view::npos) {
+		return false;
+	}
+	signature.code = code;
+	signature.trampoline = find_trampoline(signature.args(), signature.ret());
+	return true;
+}
+
+void ffi_push(DCCallVM* dc, const Signature& signature, const Value* args) {
+	dcReset(dc);
+	for (auto c : signature.args()) {
+		auto const& arg = *args++;
+		switch (c) {
+		case 'B': dcArgBool(dc, arg.i64 != 0); break;
+		case 'c': dcArgChar(dc, DCchar(arg.i64)); break;
+		case 's': dcArgShort(dc, DCshort(arg.i64)); break;
+		case 'i': dcArgInt(dc, DCint(arg.i64)); break;
+		case 'j': dcArgLong(dc, DClong(arg.i64)); break;
+		case 'l': dcArgLongLong(dc, arg.i64); break;
+		case 'f': dcArgFloat(dc, DCfloat(arg.f64)); break;
+		case 'd': dcArgDouble(dc, arg.f64); break;
+		case 'p': dcArgPointer(dc, arg.p); break;
+		}
+	}
+}
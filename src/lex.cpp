@@ -1,9 +1,128 @@
 #include "lex.h"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
 #include <fstream>
-#include <map>
 
-static const std::map<std::string_view, token_type> keywords {
+/*
+ * Character class scanners for the hot lexer loops. With L_SIMD they
+ * classify 16 (SSE2) or 32 (AVX2) bytes per step, the scalar loop only
+ * handles the tail of the source. AVX2 is used when the compiler targets
+ * it, e.g. with -mavx2 or -march=native.
+ */
+#if !defined(L_SIMD)
+#if defined(__AVX2__) || defined(__SSE2__)
+#define L_SIMD 1
+#else
+#define L_SIMD 0
+#endif
+#endif
+
+#if L_SIMD
+#include <immintrin.h>
+
+#if defined(__AVX2__)
+using vec = __m256i;
+static vec load(const char* p) { return _mm256_loadu_si256((const vec*) p); }
+static vec splat(char c) { return _mm256_set1_epi8(c); }
+static vec cmpeq(vec a, vec b) { return _mm256_cmpeq_epi8(a, b); }
+static vec cmpgt(vec a, vec b) { return _mm256_cmpgt_epi8(a, b); }
+static vec either(vec a, vec b) { return _mm256_or_si256(a, b); }
+static vec both(vec a, vec b) { return _mm256_and_si256(a, b); }
+static uint32_t movemask(vec v) { return _mm256_movemask_epi8(v); }
+#else
+using vec = __m128i;
+static vec load(const char* p) { return _mm_loadu_si128((const vec*) p); }
+static vec splat(char c) { return _mm_set1_epi8(c); }
+static vec cmpeq(vec a, vec b) { return _mm_cmpeq_epi8(a, b); }
+static vec cmpgt(vec a, vec b) { return _mm_cmpgt_epi8(a, b); }
+static vec either(vec a, vec b) { return _mm_or_si128(a, b); }
+static vec both(vec a, vec b) { return _mm_and_si128(a, b); }
+static uint32_t movemask(vec v) { return _mm_movemask_epi8(v); }
+#endif
+
+/* signed compares, so bytes >= 0x80 are never inside a range */
+static vec in_range(vec c, char lo, char hi) {
+	return both(cmpgt(c, splat(lo - 1)), cmpgt(splat(hi + 1), c));
+}
+#endif
+
+struct SpaceClass {
+	static bool test(char c) {
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\x0C';
+	}
+#if L_SIMD
+	static uint32_t test(vec c) {
+		auto blank = either(cmpeq(c, splat(' ')), cmpeq(c, splat('\t')));
+		auto line = either(cmpeq(c, splat('\n')), cmpeq(c, splat('\r')));
+		return movemask(either(either(blank, line), cmpeq(c, splat('\x0C'))));
+	}
+#endif
+};
+
+struct DigitClass {
+	static bool test(char c) {
+		return c >= '0' && c <= '9';
+	}
+#if L_SIMD
+	static uint32_t test(vec c) {
+		return movemask(in_range(c, '0', '9'));
+	}
+#endif
+};
+
+struct IdentClass {
+	static bool test(char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+	}
+#if L_SIMD
+	static uint32_t test(vec c) {
+		/* setting bit 5 folds upper case onto lower case and nothing else onto a..z */
+		auto letter = in_range(either(c, splat(0x20)), 'a', 'z');
+		return movemask(either(either(letter, in_range(c, '0', '9')), cmpeq(c, splat('_'))));
+	}
+#endif
+};
+
+/* everything a string literal can contain without special handling */
+struct StringClass {
+	static bool test(char c) {
+		return c != '"' && c != '\n' && c != '\\';
+	}
+#if L_SIMD
+	static uint32_t test(vec c) {
+		return ~movemask(either(either(cmpeq(c, splat('"')), cmpeq(c, splat('\n'))), cmpeq(c, splat('\\'))));
+	}
+#endif
+};
+
+/* index of the first byte at or after 'i' outside of 'Class', test(vec) gives a bit per byte inside */
+template <typename Class>
+static size_t scan(std::string_view src, size_t i) {
+#if L_SIMD
+	constexpr uint32_t all = sizeof(vec) == 32 ? 0xFFFFFFFF : 0xFFFF;
+	while (i + sizeof(vec) <= src.size()) {
+		auto outside = ~Class::test(load(src.data() + i)) & all;
+		if (outside != 0) {
+			return i + std::countr_zero(outside);
+		}
+		i += sizeof(vec);
+	}
+#endif
+	while (i < src.size() && Class::test(src[i])) {
+		i++;
+	}
+	return i;
+}
+
+struct Keyword {
+	std::string_view name;
+	token_type type;
+};
+
+static constexpr Keyword keywords[] {
 	{"break", token_type::kw_break},
 	{"do", token_type::kw_do},
 	{"else", token_type::kw_else},
@@ -23,64 +142,171 @@ static const std::map<std::string_view, token_type> keywords {
 	{"extern", token_type::kw_extern},
 	{"import", token_type::kw_import},
 	{"export", token_type::kw_export},
-	{"match", token_type::kw_match}
+	{"match", token_type::kw_match},
+	{"mut", token_type::kw_mut}
 };
 
+/*
+ * Perfect hash over the keyword table: each keyword owns a slot, so looking
+ * an identifier up costs one hash, one load and at most one compare. The
+ * static_assert below fires when a new keyword collides, retune the
+ * multipliers then.
+ */
+static constexpr size_t keyword_hash(std::string_view s) {
+	return (uint8_t(s[0]) + 5 * uint8_t(s.back()) + 14 * uint8_t(s[1])) & 63;
+}
+
+static constexpr auto keyword_slots = [] {
+	std::array<int8_t, 64> slots{};
+	slots.fill(-1);
+	for (size_t i = 0; i < std::size(keywords); i++) {
+		slots[keyword_hash(keywords[i].name)] = int8_t(i);
+	}
+	return slots;
+}();
+
+static constexpr auto keyword_length = [] {
+	std::pair<size_t, size_t> length{SIZE_MAX, 0};
+	for (auto const& keyword : keywords) {
+		length.first = std::min(length.first, keyword.name.size());
+		length.second = std::max(length.second, keyword.name.size());
+	}
+	return length;
+}();
+
+static_assert(keyword_length.first >= 2, "keyword_hash reads two characters");
+static_assert([] {
+	for (size_t i = 0; i < std::size(keywords); i++) {
+		if (keyword_slots[keyword_hash(keywords[i].name)] != int8_t(i)) {
+			return false;
+		}
+	}
+	return true;
+}(), "keyword_hash has a collision");
+
+static token_type find_keyword(std::string_view s) {
+	if (s.size() < keyword_length.first || s.size() > keyword_length.second) {
+		return token_type::identifier;
+	}
+	auto slot = keyword_slots[keyword_hash(s)];
+	if (slot < 0 || keywords[slot].name != s) {
+		return token_type::identifier;
+	}
+	return keywords[slot].type;
+}
+
+uint32_t SymbolTable::intern(std::string_view name) {
+	if (2 * (names.size() + 1) > slots.size()) {
+		std::vector<uint32_t> grown(std::max<size_t>(256, 2 * slots.size()));
+		for (uint32_t id = 0; id < names.size(); id++) {
+			auto i = std::hash<std::string_view>{}(names[id]);
+			while (grown[i & (grown.size() - 1)] != 0) {
+				i++;
+			}
+			grown[i & (grown.size() - 1)] = id + 1;
+		}
+		slots = std::move(grown);
+	}
+
+	auto i = std::hash<std::string_view>{}(name);
+	while (true) {
+		auto& slot = slots[i & (slots.size() - 1)];
+		if (slot == 0) {
+			slot = names.size() + 1;
+			names.emplace_back(name);
+			return slot - 1;
+		}
+		if (names[slot - 1] == name) {
+			return slot - 1;
+		}
+		i++;
+	}
+}
+
 token_type LexState::read_ident() {
-	token.raw_string = take_while([](char c) {
-		return isalnum(c) || (c == '_');
-	});
-	token.string = token.raw_string;
-
-	auto keyword = keywords.find(token.raw_string);
-	return keyword != keywords.end()
-		? keyword->second
-		: token_type::identifier;
+	auto start = char_index;
+	char_index = scan<IdentClass>(src, char_index);
+	token.string = src.substr(start, char_index - start);
+
+	auto type = find_keyword(token.string);
+	if (type == token_type::identifier) {
+		token.symbol = symbols.intern(token.string);
+	}
+	return type;
 }
 
 token_type LexState::read_number() {
-	int32_t number = 0;
-	token.raw_string = take_while([&number](char c) -> bool {
-		if (!isdigit(c)) return false;
-		number = number * 10 + (c - '0');
-		return true;
-	});
+	auto start = char_index;
+	char_index = scan<DigitClass>(src, char_index);
+	token.string = src.substr(start, char_index - start);
+
+	int64_t number = 0;
+	bool overflow = false;
+	for (auto c : token.string) {
+		overflow |= number > (INT64_MAX - (c - '0')) / 10;
+		number = int64_t(uint64_t(number) * 10 + (c - '0'));
+	}
 	token.integer = number;
-	token.string = token.raw_string;
+
+	/* a '.' followed by a digit makes it a float, '1..2' stays a concat */
+	if (char_index + 1 < src.size() && peek() == '.' && isdigit(src[char_index + 1])) {
+		char_index = scan<DigitClass>(src, char_index + 1);
+		token.string = src.substr(start, char_index - start);
+		std::from_chars(token.string.data(), token.string.data() + token.string.size(), token.number);
+		return token_type::float_literal;
+	}
+	if (overflow) {
+		fprintf(stderr, "integer literal '%.*s' too large\n", int(token.string.size()), token.string.data());
+		abort();
+	}
 	return token_type::integer_literal;
 }
 
 token_type LexState::read_string() {
 	advance();
 
-	std::string buf;
-
-	token.raw_string = take_while([this, &buf](char c) -> bool {
-		switch (c) {
-		case '"':
-		case '\n':
-			return false;
-		case '\\':
-			advance();
-			switch (peek()) {
-			case 'n': c = '\n'; break;
-			case 'r': c = '\r'; break;
-			case 't': c = '\t'; break;
-			case 'v': c = '\v'; break;
-			default:
-				fprintf(stderr, "invalid char '%c'\n", peek());
-				abort();
-			}
-			[[fallthrough]];
+	auto start = char_index;
+	size_t escapes = 0;
+	while (true) {
+		char_index = scan<StringClass>(src, char_index);
+		if (eof() || peek() != '\\') {
+			break;
+		}
+		advance();
+		switch (eof() ? '\0' : peek()) {
+		case 'n': case 'r': case 't': case 'v':
+			escapes++;
+			advance();
+			break;
 		default:
-			buf.push_back(c);
-			return true;
+			fprintf(stderr, "invalid char '%c'\n", eof() ? ' ' : peek());
+			abort();
 		}
-	});
+	}
+	auto raw = src.substr(start, char_index - start);
 
-	token.string = std::move(buf);
+	/* only literals with escapes need memory of their own */
+	if (escapes == 0) {
+		token.string = raw;
+	} else {
+		auto buf = strings.allocate(raw.size() - escapes);
+		size_t size = 0;
+		for (size_t i = 0; i < raw.size(); i++) {
+			auto c = raw[i];
+			if (c == '\\') {
+				switch (raw[++i]) {
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case 'v': c = '\v'; break;
+				}
+			}
+			buf[size++] = c;
+		}
+		token.string = {buf, size};
+	}
 
-	if (peek() != '"') {
+	if (eof() || peek() != '"') {
 		fprintf(stderr, "unterminated string\n");
 		abort();
 	}
@@ -95,7 +321,7 @@ token_type LexState::read_token() {
 		case '\n': case '\r':
 		case ' ': case '\t':
 		case '\x0C':
-			advance();
+			char_index = scan<SpaceClass>(src, char_index);
 			continue;
 		case 'a'...'z':
 		case 'A'...'Z':
@@ -162,6 +388,7 @@ token_type LexState::read_token() {
 		case '!':
 			advance();
 			if (peek() == '=') {
+				advance();
 				return token_type::ne;
 			}
 			return token_type::logical_not;
@@ -0,0 +1,54 @@
+#include "lstring.hpp"
+
+#include <cstring>
+#include <functional>
+
+/* a body of 'size' bytes, its text is left to the caller */
+static String* new_string(Arena& arena, size_t size) {
+	auto s = reinterpret_cast<String*>(arena.allocate(sizeof(String) + size + 1));
+	s->size = uint32_t(size);
+	return s;
+}
+
+static uint64_t finish(String* s) {
+	auto text = const_cast<char*>(s->data());
+	text[s->size] = '\0';
+	s->hash = uint32_t(std::hash<std::string_view>{}({text, s->size}));
+	return reinterpret_cast<uint64_t>(s);
+}
+
+uint64_t make_string(Arena& arena, std::string_view text) {
+	if (text.size() <= MAX_INLINE_STRING) {
+		uint64_t bits = text.size() << 1 | 1;
+		std::memcpy(reinterpret_cast<char*>(&bits) + 1, text.data(), text.size());
+		return bits;
+	}
+	auto s = new_string(arena, text.size());
+	std::memcpy(const_cast<char*>(s->data()), text.data(), text.size());
+	return finish(s);
+}
+
+uint64_t string_concat(Arena& arena, uint64_t lhs, uint64_t rhs) {
+	auto a = string_view(lhs);
+	auto b = string_view(rhs);
+	if (b.empty()) {
+		return lhs;
+	}
+	if (a.empty()) {
+		return rhs;
+	}
+
+	auto size = a.size() + b.size();
+	if (size <= MAX_INLINE_STRING) {
+		uint64_t bits = size << 1 | 1;
+		auto text = reinterpret_cast<char*>(&bits) + 1;
+		std::memcpy(text, a.data(), a.size());
+		std::memcpy(text + a.size(), b.data(), b.size());
+		return bits;
+	}
+	auto s = new_string(arena, size);
+	auto text = const_cast<char*>(s->data());
+	std::memcpy(text, a.data(), a.size());
+	std::memcpy(text + a.size(), b.data(), b.size());
+	return finish(s);
+}
@@ -2,11 +2,93 @@
 #include "parser.h"
 #include "lex.h"
 
+#include <algorithm>
+#include <bit>
+#include <optional>
+
 struct Expression {
+	enum Kind {
+		Temp,		// value lives in a temporary owned by the expression
+		Local,		// value lives in a variable's slot and is read in place
+		Compare,	// flags are set, 'jump' is taken when the comparison holds
+		Constant,	// value is known at compile time and not materialized yet
+		Field,		// value is slot 'offset' of the struct block whose address is in 'slot'
+	};
+
+	Kind kind;
 	Slot slot;
 	Type type;
+	OPCODE jump = NOP;
+	bool is_mutable = false;
+	int64_t value = 0;		// float and string constants keep their bits here
+	bool unordered = false;	// float comparison, neither 'jump' nor its inverse is taken for NaN
+	bool fresh = false;		// a struct block nothing else refers to yet
+	uint32_t offset = 0;
 };
 
+static Expression constant(int64_t value, Type type) {
+	return {Expression::Constant, {-1}, std::move(type), NOP, false, value};
+}
+
+static Expression constant(double value) {
+	return constant(std::bit_cast<int64_t>(value), FloatType{});
+}
+
+static double number(const Expression& e) {
+	return std::bit_cast<double>(e.value);
+}
+
+static std::string_view text(const Expression& e) {
+	return string_view(reinterpret_cast<const uint64_t&>(e.value));
+}
+
+static bool is_float(const Type& type) {
+	return std::holds_alternative<FloatType>(type);
+}
+
+static bool is_string(const Type& type) {
+	return std::holds_alternative<StringType>(type);
+}
+
+static bool is_numeric(const Type& type) {
+	return std::holds_alternative<IntType>(type) || is_float(type);
+}
+
+static bool same_type(const Type& lhs, const Type& rhs) {
+	return lhs.index() == rhs.index() && as_struct(lhs) == as_struct(rhs);
+}
+
+/* a struct kept in a heap block rather than in registers */
+static bool is_block(const Type& type) {
+	auto s = as_struct(type);
+	return s != nullptr && !s->in_registers();
+}
+
+/* the comparison that holds when the operands are swapped */
+static OPCODE mirror(OPCODE jump) {
+	switch (jump) {
+	case JLT: return JGT;
+	case JLE: return JGE;
+	case JGT: return JLT;
+	case JGE: return JLE;
+	default:
+		return jump;
+	}
+}
+
+static OPCODE invert(OPCODE jump) {
+	switch (jump) {
+	case JE: return JNE;
+	case JNE: return JE;
+	case JLT: return JGE;
+	case JLE: return JGT;
+	case JGT: return JLE;
+	case JGE: return JLT;
+	default:
+		abort();
+	}
+}
+
 static bool check(LexState &ls, token_type type) {
 	return ls.token.type == type;
 }
@@ -43,11 +125,11 @@ static void consume(LexState& ls, token_type type) {
 //}
 
 static void enter_scope(Environment& env, LexState& ls) {
-	ls.fs->scopes.emplace_front();
+	ls.fs->enter_block();
 }
 
 static void leave_scope(Environment& env, LexState& ls) {
-	ls.fs->scopes.pop_front();
+	ls.fs->leave_block();
 }
 
 static FuncState* enter_func(Environment& env, LexState& ls, FuncState& new_fs) {
@@ -60,9 +142,22 @@ static FuncState* enter_func(Environment& env, LexState& ls, FuncState& new_fs)
 extern void dump(FuncState& fs);
 
 static void leave_func(Environment& env, LexState& ls) {
-	ls.fs->ir.Ret();
+	if (falls_through(ls.fs->ir.instructions)) {
+		if (!std::holds_alternative<VoidType>(env.functions[ls.fs->index].type->return_type)) {
+			fmt::print("'{}' can reach its end without returning a value\n", ls.fs->name);
+			abort();
+		}
+		ls.fs->ir.Ret();
+	}
+	ls.fs->stack_size = ls.fs->ir.optimize(ls.fs->stack_size);
 
 	dump(*ls.fs);
+
+	auto& fn = env.functions[ls.fs->index];
+	fn.stack_size = ls.fs->stack_size;
+	fn.ir = std::move(ls.fs->ir);
+	link(fn, env);
+
 	ls.fs = ls.fs->top;
 }
 
@@ -70,12 +165,414 @@ Expression expression(Environment& env, LexState &ls);
 void statement(Environment& env, LexState &ls);
 void return_statement(Environment& env, LexState &ls);
 void statement_list(Environment& env, LexState &ls);
+static void else_statement(Environment& env, LexState &ls);
 
-std::string checkname(Environment& env, LexState &ls) {
+/* returns the identifier's symbol, LexState::symbols maps it back to the name */
+uint32_t checkname(Environment& env, LexState &ls) {
 	expect(ls, token_type::identifier);
-	auto s = std::move(ls.token.string);
+	auto symbol = ls.token.symbol;
 	ls.next();
-	return std::move(s);
+	return symbol;
+}
+
+static void declare(LexState& ls, FuncState& fs, uint32_t symbol, Variable variable) {
+	if (!fs.declare(symbol, std::move(variable))) {
+		fmt::print("redefinition of '{}'\n", ls.symbols.name(symbol));
+	}
+}
+
+static Variable get_variable(LexState& ls, uint32_t symbol) {
+	auto variable = ls.fs->find(symbol);
+	if (variable == nullptr) {
+		fmt::print("'{}' is not defined\n", ls.symbols.name(symbol));
+		abort();
+	}
+	return *variable;
+}
+
+static void free_expression(LexState& ls, const Expression& e) {
+	if (e.kind == Expression::Temp) {
+		for (uint32_t i = 0; i < registers(e.type); i++) {
+			ls.fs->deallocate({e.slot.location + int(i)});
+		}
+	}
+}
+
+/* reads the field 'e' into the registers from 'dest', a nested block is read as its address */
+static void load_field(LexState& ls, const Expression& e, Slot dest) {
+	if (is_block(e.type)) {
+		ls.fs->ir.EmitABC(FIELDPTR, dest.location, e.slot.location, e.offset);
+		return;
+	}
+	for (uint32_t i = 0; i < registers(e.type); i++) {
+		ls.fs->ir.EmitABC(GETFIELD, dest.location + i, e.slot.location, e.offset + i);
+	}
+}
+
+static void store(Environment& env, LexState& ls, const Expression& e, Slot dest) {
+	switch (e.kind) {
+	case Expression::Constant:
+		/* ints that fit ISTORE stay inline, everything else is a constant */
+		if (is_float(e.type) || is_string(e.type) || e.value < INT32_MIN || e.value > INT32_MAX) {
+			ls.fs->ir.LoadK(dest.location, env.constant(e.value));
+		} else {
+			ls.fs->ir.LoadInt(dest.location, int32_t(e.value));
+		}
+		break;
+	case Expression::Compare: {
+		ls.fs->ir.LoadInt(dest.location, 1);
+		auto skip = ls.fs->ir.EmitsAx(e.jump, 0);
+		ls.fs->ir.LoadInt(dest.location, 0);
+		ls.fs->ir.instructions[skip].sAx = ls.fs->ir.instructions.size();
+		break;
+	}
+	case Expression::Field:
+		load_field(ls, e, dest);
+		break;
+	case Expression::Temp:
+	case Expression::Local:
+		/* a struct in registers moves one register at a time */
+		for (uint32_t i = 0; i < registers(e.type) && e.slot.location != dest.location; i++) {
+			ls.fs->ir.Store(dest.location + i, e.slot.location + i);
+		}
+		free_expression(ls, e);
+		break;
+	}
+}
+
+static Expression discharge(Environment& env, LexState& ls, Expression e) {
+	if (e.kind != Expression::Compare && e.kind != Expression::Field) {
+		return e;
+	}
+	auto temp = ls.fs->allocate(registers(e.type));
+	store(env, ls, e, temp);
+	return {Expression::Temp, temp, std::move(e.type), NOP, e.is_mutable};
+}
+
+/* makes the value readable from a register */
+static Expression to_register(Environment& env, LexState& ls, Expression e) {
+	if (e.kind == Expression::Temp || e.kind == Expression::Local) {
+		return e;
+	}
+	auto temp = ls.fs->allocate(registers(e.type));
+	store(env, ls, e, temp);
+	return {Expression::Temp, temp, std::move(e.type), NOP, e.is_mutable};
+}
+
+/* a new block with the contents of the block struct 'e' */
+static Expression copy_block(Environment& env, LexState& ls, Expression e) {
+	auto size = as_struct(e.type)->size;
+	e = to_register(env, ls, std::move(e));
+	auto temp = ls.fs->allocate();
+	ls.fs->ir.EmitABC(NEWSTRUCT, temp.location, size, 0);
+	ls.fs->ir.EmitABC(SCOPY, temp.location, e.slot.location, size);
+	free_expression(ls, e);
+
+	Expression copy{Expression::Temp, temp, e.type};
+	copy.fresh = true;
+	return copy;
+}
+
+/* writes 'e' to the field of type 'type' at 'offset' in the block 'base' points at */
+static void store_field(Environment& env, LexState& ls, Slot base, uint32_t offset, const Type& type, Expression e) {
+	e = to_register(env, ls, std::move(e));
+	if (is_block(type)) {
+		auto field = ls.fs->allocate();
+		ls.fs->ir.EmitABC(FIELDPTR, field.location, base.location, offset);
+		ls.fs->ir.EmitABC(SCOPY, field.location, e.slot.location, as_struct(type)->size);
+		ls.fs->deallocate(field);
+	} else {
+		for (uint32_t i = 0; i < registers(type); i++) {
+			ls.fs->ir.EmitABC(SETFIELD, base.location, offset + i, e.slot.location + i);
+		}
+	}
+	free_expression(ls, e);
+}
+
+static bool fits_sC(int64_t value) {
+	return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+/* what sBx holds behind a WIDE word */
+static bool fits_wide_sBx(int64_t value) {
+	return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+/*
+ * Evaluates 'lhs op rhs' the way the VM would. Division by zero and
+ * INT64_MIN / -1 are left to the VM so they fault at run time exactly as
+ * before.
+ */
+static std::optional<int64_t> fold(OPCODE op, int64_t lhs, int64_t rhs) {
+	int64_t value;
+	switch (op) {
+	case IADD:
+		value = int64_t(uint64_t(lhs) + uint64_t(rhs));
+		break;
+	case ISUB:
+		value = int64_t(uint64_t(lhs) - uint64_t(rhs));
+		break;
+	case IMUL:
+		value = int64_t(uint64_t(lhs) * uint64_t(rhs));
+		break;
+	case IDIV:
+	case IMOD:
+		if (rhs == 0 || (lhs == INT64_MIN && rhs == -1)) {
+			return std::nullopt;
+		}
+		value = op == IDIV ? lhs / rhs : lhs % rhs;
+		break;
+	default:
+		return std::nullopt;
+	}
+	return value;
+}
+
+/* floats fold unconditionally, IEEE arithmetic gives the same result at run time */
+static double fold(OPCODE op, double lhs, double rhs) {
+	switch (op) {
+	case IADD: return lhs + rhs;
+	case ISUB: return lhs - rhs;
+	case IMUL: return lhs * rhs;
+	case IDIV: return lhs / rhs;
+	default:
+		abort();
+	}
+}
+
+template <typename T>
+static bool holds(OPCODE jump, T lhs, T rhs) {
+	switch (jump) {
+	case JE: return lhs == rhs;
+	case JNE: return lhs != rhs;
+	case JLT: return lhs < rhs;
+	case JLE: return lhs <= rhs;
+	case JGT: return lhs > rhs;
+	case JGE: return lhs >= rhs;
+	default:
+		abort();
+	}
+}
+
+/* IADD..IMOD name the operation, the operand type picks the opcode family */
+static Expression arithmetic(Environment& env, LexState& ls, OPCODE op, Expression lhs, Expression rhs) {
+	if (!is_numeric(lhs.type) || !same_type(lhs.type, rhs.type)) {
+		fmt::print("invalid operands to arithmetic\n");
+		abort();
+	}
+	if (is_float(lhs.type)) {
+		if (op == IMOD) {
+			fmt::print("'%' is not defined for float\n");
+			abort();
+		}
+		if (lhs.kind == Expression::Constant && rhs.kind == Expression::Constant) {
+			return constant(fold(op, number(lhs), number(rhs)));
+		}
+		lhs = to_register(env, ls, std::move(lhs));
+		rhs = to_register(env, ls, std::move(rhs));
+		free_expression(ls, rhs);
+		free_expression(ls, lhs);
+
+		auto temp = ls.fs->allocate();
+		ls.fs->ir.EmitABC(OPCODE(op - IADD + FADD), temp.location, lhs.slot.location, rhs.slot.location);
+		return {Expression::Temp, temp, FloatType{}};
+	}
+
+	if (lhs.kind == Expression::Constant && rhs.kind == Expression::Constant) {
+		if (auto value = fold(op, lhs.value, rhs.value)) {
+			return constant(*value, lhs.type);
+		}
+	}
+
+	if (lhs.kind == Expression::Constant && rhs.kind != Expression::Constant && (op == IADD || op == IMUL)) {
+		std::swap(lhs, rhs);
+	}
+	if (rhs.kind == Expression::Constant && fits_sC(rhs.value)) {
+		lhs = to_register(env, ls, std::move(lhs));
+		free_expression(ls, lhs);
+
+		auto temp = ls.fs->allocate();
+		ls.fs->ir.EmitABsC(OPCODE(op - IADD + IADDK), temp.location, lhs.slot.location, rhs.value);
+		return {Expression::Temp, temp, lhs.type};
+	}
+
+	lhs = to_register(env, ls, std::move(lhs));
+	rhs = to_register(env, ls, std::move(rhs));
+	free_expression(ls, rhs);
+	free_expression(ls, lhs);
+
+	auto temp = ls.fs->allocate();
+	ls.fs->ir.EmitABC(op, temp.location, lhs.slot.location, rhs.slot.location);
+	return {Expression::Temp, temp, lhs.type};
+}
+
+static size_t jump_if_false(Environment& env, LexState& ls, Expression condition) {
+	if (condition.kind == Expression::Compare && condition.unordered) {
+		ls.fs->ir.EmitsAx(condition.jump, ls.fs->ir.instructions.size() + 2);
+		return ls.fs->ir.EmitsAx(JMP, 0);
+	}
+	if (condition.kind == Expression::Compare) {
+		return ls.fs->ir.EmitsAx(invert(condition.jump), 0);
+	}
+	condition = to_register(env, ls, std::move(condition));
+	free_expression(ls, condition);
+	ls.fs->ir.Test(condition.slot.location);
+	return ls.fs->ir.EmitsAx(JE, 0);
+}
+
+static void patch(LexState& ls, size_t jump) {
+	ls.fs->ir.instructions[jump].sAx = ls.fs->ir.instructions.size();
+}
+
+static OPCODE xcall_opcode(char ret) {
+	switch (ret) {
+	case 'i': return xCALLi;
+	case 'l': return xCALLl;
+	case 'd': return xCALLd;
+	case 'p': return xCALLp;
+	default: return xCALLv;
+	}
+}
+
+/*
+ * Arguments are evaluated straight into the registers above everything the
+ * caller uses, which become the callee's first registers. The result comes
+ * back in the first of them. Host functions read their arguments from the
+ * same registers. A struct in registers takes as many as it has slots.
+ * Every signature is known before any body is compiled, see
+ * declare_signatures().
+ */
+static Expression call_expression(Environment& env, LexState& ls, std::string_view name) {
+	auto it = env.function_index.find(name);
+	if (it == env.function_index.end() || !env.functions[it->second].defined) {
+		fmt::print("'{}' is not defined\n", name);
+		abort();
+	}
+	auto index = it->second;
+	auto base = ls.fs->free_top();
+	auto type = env.functions[index].type;
+
+	consume(ls, token_type::left_paren);
+	int count = 0;
+	int size = 0;	/* registers the arguments take */
+	if (!check(ls, token_type::right_paren)) {
+		do {
+			if (size_t(count) == type->args.size()) {
+				fmt::print("'{}' expects {} arguments, got more\n", name, type->args.size());
+				abort();
+			}
+			auto const& expected = type->args[count];
+			int width = registers(expected);
+			Slot slot{base + size};
+			for (int i = 0; i < width; i++) {
+				ls.fs->claim(base + size + i);
+			}
+			count++;
+			size += width;
+
+			auto arg = expression(env, ls);
+			if (!same_type(arg.type, expected)) {
+				fmt::print("argument {} of '{}' has the wrong type\n", count, name);
+				abort();
+			}
+			/* the callee may keep what it is given, it must not change under it */
+			if (is_block(arg.type) && arg.is_mutable) {
+				arg = copy_block(env, ls, std::move(arg));
+			}
+			store(env, ls, arg, slot);
+		} while (skip(ls, token_type::comma));
+	}
+	consume(ls, token_type::right_paren);
+
+	if (type->args.size() != size_t(count)) {
+		fmt::print("'{}' expects {} arguments, got {}\n", name, type->args.size(), count);
+		abort();
+	}
+
+	/* the result takes the registers from 'base' */
+	int result = registers(type->return_type);
+	for (int i = size; i < result; i++) {
+		ls.fs->claim(base + i);
+	}
+	for (int i = result; i < size; i++) {
+		ls.fs->deallocate({base + i});
+	}
+	/* C holds 16 bits behind a WIDE word */
+	auto const& callees = ls.fs->ir.callees;
+	if (callees.size() > UINT16_MAX && std::find(callees.begin(), callees.end(), index) == callees.end()) {
+		fmt::print("too many functions called from '{}'\n", ls.fs->name);
+		abort();
+	}
+	if (env.functions[index].batch_capacity) {
+		/* outside loops there is nothing to batch with */
+		ls.fs->ir.xBatch(base, size, index);
+		if (ls.fs->loops.empty()) {
+			ls.fs->ir.xFlush(index);
+		} else if (std::find(ls.fs->loops.back().begin(), ls.fs->loops.back().end(), index) == ls.fs->loops.back().end()) {
+			ls.fs->loops.back().push_back(index);
+		}
+	} else if (auto signature = env.functions[index].signature) {
+		ls.fs->ir.xCall(xcall_opcode(signature->ret()), base, size, index);
+	} else {
+		ls.fs->ir.Call(base, size, index);
+	}
+
+	return {Expression::Temp, {base}, type->return_type};
+}
+
+/* Name { field: value, ... }, every field given once, in any order */
+static Expression struct_expression(Environment& env, LexState& ls, StructType* type) {
+	consume(ls, token_type::left_curve);
+
+	Slot slot;
+	if (type->in_registers()) {
+		slot = ls.fs->allocate(type->size);
+	} else {
+		slot = ls.fs->allocate();
+		ls.fs->ir.EmitABC(NEWSTRUCT, slot.location, type->size, 0);
+	}
+
+	std::vector<bool> given(type->fields.size());
+	while (!check(ls, token_type::right_curve)) {
+		auto name = ls.symbols.name(checkname(env, ls));
+		auto i = type->field(name);
+		if (i < 0) {
+			fmt::print("'{}' has no field '{}'\n", type->name, name);
+			abort();
+		}
+		if (given[i]) {
+			fmt::print("'{}' gets field '{}' twice\n", type->name, name);
+			abort();
+		}
+		given[i] = true;
+		consume(ls, token_type::colon);
+
+		auto value = expression(env, ls);
+		if (!same_type(value.type, type->fields[i])) {
+			fmt::print("field '{}' of '{}' has the wrong type\n", name, type->name);
+			abort();
+		}
+		if (type->in_registers()) {
+			store(env, ls, value, {slot.location + int(type->offsets[i])});
+		} else {
+			store_field(env, ls, slot, type->offsets[i], type->fields[i], std::move(value));
+		}
+		if (!skip(ls, token_type::comma)) {
+			break;
+		}
+	}
+	consume(ls, token_type::right_curve);
+
+	for (size_t i = 0; i < given.size(); i++) {
+		if (!given[i]) {
+			fmt::print("'{}' needs a value for '{}'\n", type->name, type->names[i]);
+			abort();
+		}
+	}
+
+	Expression e{Expression::Temp, slot, type};
+	e.fresh = !type->in_registers();
+	return e;
 }
 
 Expression primary_expression(Environment& env, LexState &ls) {
@@ -85,67 +582,181 @@ Expression primary_expression(Environment& env, LexState &ls) {
 		return temp;
 	}
 	if (skip(ls, token_type::kw_false)) {
-		auto temp = ls.fs->allocate();
-		ls.fs->ir.LoadInt(temp.location, 0);
-		return {temp, BoolType{}};
+		return constant(0, BoolType{});
 	}
 	if (skip(ls, token_type::kw_true)) {
-		auto temp = ls.fs->allocate();
-		ls.fs->ir.LoadInt(temp.location, 1);
-		return {temp, BoolType{}};
+		return constant(1, BoolType{});
 	}
 	if (skip(ls, token_type::integer_literal)) {
-		auto temp = ls.fs->allocate();
-		ls.fs->ir.LoadInt(temp.location, ls.prev_token.integer);
-		return {temp, IntType{}};
+		return constant(ls.prev_token.integer, IntType{});
 	}
 	if (skip(ls, token_type::float_literal)) {
-//		return FloatLiteral{ls.prev_token.number};
-		abort();
+		return constant(ls.prev_token.number);
 	}
 	if (skip(ls, token_type::string_literal)) {
-//		return StringLiteral{std::move(ls.prev_token.string)};
-		abort();
+		return constant(env.string(ls.prev_token.string), StringType{});
 	}
 	auto name = checkname(env, ls);
-	auto [slot, type] = ls.fs->get(name);
-	auto temp = ls.fs->allocate();
-	ls.fs->ir.Store(temp.location, slot.location);
-	return {temp, type};
+	if (check(ls, token_type::left_paren)) {
+		return call_expression(env, ls, ls.symbols.name(name));
+	}
+	if (check(ls, token_type::left_curve)) {
+		if (auto type = env.find_struct(ls.symbols.name(name))) {
+			return struct_expression(env, ls, type);
+		}
+	}
+	auto variable = get_variable(ls, name);
+	if (variable.constant) {
+		return constant(*variable.constant, variable.type);
+	}
+	return {Expression::Local, variable.slot, variable.type, NOP, variable.is_mutable};
+}
+
+static bool is_assignment(token_type type) {
+	switch (type) {
+	case token_type::assign:
+	case token_type::plus_assign:
+	case token_type::minus_assign:
+	case token_type::multiply_assign:
+	case token_type::divide_assign:
+	case token_type::modulo_assign:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Field offsets add up at compile time. A field of a struct in registers is
+ * the register at its offset, one in a block stays a Field so it can be
+ * assigned to, and is read with a single GETFIELD otherwise.
+ */
+Expression postfix_expression(Environment& env, LexState& ls) {
+	auto e = primary_expression(env, ls);
+	bool temp_block = false;	/* a Field of a block only this expression refers to */
+	while (skip(ls, token_type::dot)) {
+		auto type = as_struct(e.type);
+		if (type == nullptr) {
+			fmt::print("'.' expects a struct\n");
+			abort();
+		}
+		auto name = ls.symbols.name(checkname(env, ls));
+		auto i = type->field(name);
+		if (i < 0) {
+			fmt::print("'{}' has no field '{}'\n", type->name, name);
+			abort();
+		}
+		auto offset = type->offsets[i];
+		auto const& field = type->fields[i];
+
+		if (e.kind == Expression::Field) {
+			e.offset += offset;
+		} else if (!type->in_registers()) {
+			temp_block = e.kind == Expression::Temp;
+			e = {Expression::Field, e.slot, field, NOP, e.is_mutable};
+			e.offset = offset;
+		} else {
+			/* the rest of a temporary struct is given back */
+			for (uint32_t r = 0; r < type->size && e.kind == Expression::Temp; r++) {
+				if (r < offset || r >= offset + registers(field)) {
+					ls.fs->deallocate({e.slot.location + int(r)});
+				}
+			}
+			e.slot.location += offset;
+		}
+		e.type = field;
+	}
+
+	if (e.kind != Expression::Field) {
+		return e;
+	}
+	if (is_assignment(ls.token.type)) {
+		if (temp_block) {
+			fmt::print("cannot assign to a field of a temporary\n");
+			abort();
+		}
+		return e;
+	}
+	auto value = to_register(env, ls, e);
+	if (temp_block) {
+		ls.fs->deallocate(e.slot);
+	}
+	return value;
 }
 
 Expression unary_expression(Environment& env, LexState& ls) {
-	return primary_expression(env, ls);
-
-//	while (true) {
-//		if (skip(ls, token_type::logical_not)) {
-//			unary_expression(env, ls);
-//		} else if (skip(ls, token_type::bitwise_not)) {
-//			unary_expression(env, ls);
-//		} else {
-//			break;
-//		}
-//	}
+	if (skip(ls, token_type::logical_not)) {
+		auto e = unary_expression(env, ls);
+		if (!std::holds_alternative<BoolType>(e.type)) {
+			fmt::print("'!' expects a bool\n");
+			abort();
+		}
+		if (e.kind == Expression::Constant) {
+			return constant(!e.value, BoolType{});
+		}
+		if (e.kind == Expression::Compare && !e.unordered) {
+			e.jump = invert(e.jump);
+			return e;
+		}
+		e = discharge(env, ls, std::move(e));
+		free_expression(ls, e);
+
+		auto temp = ls.fs->allocate();
+		ls.fs->ir.EmitABC(NOT, temp.location, e.slot.location, 0);
+		return {Expression::Temp, temp, BoolType{}};
+	}
+	if (skip(ls, token_type::LEN)) {
+		auto e = unary_expression(env, ls);
+		if (!is_string(e.type)) {
+			fmt::print("'#' expects a string\n");
+			abort();
+		}
+		if (e.kind == Expression::Constant) {
+			return constant(int64_t(text(e).size()), IntType{});
+		}
+		e = to_register(env, ls, std::move(e));
+		free_expression(ls, e);
+
+		auto temp = ls.fs->allocate();
+		ls.fs->ir.EmitABC(SLEN, temp.location, e.slot.location, 0);
+		return {Expression::Temp, temp, IntType{}};
+	}
+	if (skip(ls, token_type::minus)) {
+		auto e = unary_expression(env, ls);
+		if (!is_numeric(e.type)) {
+			fmt::print("invalid operand to unary '-'\n");
+			abort();
+		}
+		if (e.kind == Expression::Constant) {
+			return is_float(e.type)
+				? constant(-number(e))
+				: constant(int64_t(0 - uint64_t(e.value)), IntType{});
+		}
+		e = to_register(env, ls, std::move(e));
+		free_expression(ls, e);
+
+		auto temp = ls.fs->allocate();
+		ls.fs->ir.EmitABC(is_float(e.type) ? FNEG : INEG, temp.location, e.slot.location, 0);
+		return {Expression::Temp, temp, e.type};
+	}
+	return postfix_expression(env, ls);
 }
 
 Expression multiplicative_expression(Environment& env, LexState& ls) {
 	auto ret = unary_expression(env, ls);
 	while (true) {
 		if (skip(ls, token_type::multiply)) {
-			auto rhs = unary_expression(env, ls);
-			ls.fs->deallocate(rhs.slot);
-
-			ls.fs->ir.MulInt(ret.slot.location, ret.slot.location, rhs.slot.location);
+			ret = discharge(env, ls, ret);
+			auto rhs = discharge(env, ls, unary_expression(env, ls));
+			ret = arithmetic(env, ls, IMUL, ret, rhs);
 		} else if (skip(ls, token_type::divide)) {
-			auto rhs = unary_expression(env, ls);
-			ls.fs->deallocate(rhs.slot);
-
-			ls.fs->ir.DivInt(ret.slot.location, ret.slot.location, rhs.slot.location);
+			ret = discharge(env, ls, ret);
+			auto rhs = discharge(env, ls, unary_expression(env, ls));
+			ret = arithmetic(env, ls, IDIV, ret, rhs);
 		} else if (skip(ls, token_type::modulo)) {
-			auto rhs = unary_expression(env, ls);
-			ls.fs->deallocate(rhs.slot);
-
-			ls.fs->ir.ModInt(ret.slot.location, ret.slot.location, rhs.slot.location);
+			ret = discharge(env, ls, ret);
+			auto rhs = discharge(env, ls, unary_expression(env, ls));
+			ret = arithmetic(env, ls, IMOD, ret, rhs);
 		} else {
 			break;
 		}
@@ -157,15 +768,13 @@ Expression additive_expression(Environment& env, LexState& ls) {
 	auto ret = multiplicative_expression(env, ls);
 	while (true) {
 		if (skip(ls, token_type::plus)) {
-			auto rhs = multiplicative_expression(env, ls);
-			ls.fs->deallocate(rhs.slot);
-
-			ls.fs->ir.AddInt(ret.slot.location, ret.slot.location, rhs.slot.location);
+			ret = discharge(env, ls, ret);
+			auto rhs = discharge(env, ls, multiplicative_expression(env, ls));
+			ret = arithmetic(env, ls, IADD, ret, rhs);
 		} else if (skip(ls, token_type::minus)) {
-			auto rhs = multiplicative_expression(env, ls);
-			ls.fs->deallocate(rhs.slot);
-
-			ls.fs->ir.SubInt(ret.slot.location, ret.slot.location, rhs.slot.location);
+			ret = discharge(env, ls, ret);
+			auto rhs = discharge(env, ls, multiplicative_expression(env, ls));
+			ret = arithmetic(env, ls, ISUB, ret, rhs);
 		} else {
 			break;
 		}
@@ -173,31 +782,112 @@ Expression additive_expression(Environment& env, LexState& ls) {
 	return ret;
 }
 
+/* '..' binds looser than arithmetic and tighter than comparisons */
+Expression concat_expression(Environment& env, LexState& ls) {
+	auto ret = additive_expression(env, ls);
+	while (skip(ls, token_type::concat)) {
+		ret = discharge(env, ls, ret);
+		auto rhs = discharge(env, ls, additive_expression(env, ls));
+		if (!is_string(ret.type) || !is_string(rhs.type)) {
+			fmt::print("'..' expects strings\n");
+			abort();
+		}
+		if (ret.kind == Expression::Constant && rhs.kind == Expression::Constant) {
+			ret = constant(env.string(std::string(text(ret)).append(text(rhs))), StringType{});
+			continue;
+		}
+
+		ret = to_register(env, ls, std::move(ret));
+		rhs = to_register(env, ls, std::move(rhs));
+		free_expression(ls, rhs);
+		free_expression(ls, ret);
+
+		auto temp = ls.fs->allocate();
+		ls.fs->ir.EmitABC(CONCAT, temp.location, ret.slot.location, rhs.slot.location);
+		ret = {Expression::Temp, temp, StringType{}};
+	}
+	return ret;
+}
+
 Expression shift_expression(Environment& env, LexState& ls) {
-	return additive_expression(env, ls);
+	return concat_expression(env, ls);
 }
 
 Expression comparison_expression(Environment& env, LexState& ls) {
-	return shift_expression(env, ls);
-//	while (true) {
-//		if (skip(ls, token_type::eq)) {
-//
-//		} else if (skip(ls, token_type::ne)) {
-//
-//		} else if (skip(ls, token_type::lt)) {
-//
-//		} else if (skip(ls, token_type::le)) {
-//
-//		} else if (skip(ls, token_type::gt)) {
-//
-//		} else if (skip(ls, token_type::ge)) {
-//
-//		} else if (skip(ls, token_type::cmp)) {
-//
-//		} else {
-//			break;
-//		}
-//	}
+	auto ret = shift_expression(env, ls);
+
+	OPCODE jump;
+	switch (ls.token.type) {
+	case token_type::eq: jump = JE; break;
+	case token_type::ne: jump = JNE; break;
+	case token_type::lt: jump = JLT; break;
+	case token_type::le: jump = JLE; break;
+	case token_type::gt: jump = JGT; break;
+	case token_type::ge: jump = JGE; break;
+	default:
+		return ret;
+	}
+	ls.next();
+
+	ret = discharge(env, ls, ret);
+	auto rhs = discharge(env, ls, shift_expression(env, ls));
+	if (!same_type(ret.type, rhs.type)) {
+		fmt::print("cannot compare values of different types\n");
+		abort();
+	}
+	if (as_struct(ret.type)) {
+		fmt::print("structs cannot be compared\n");
+		abort();
+	}
+	if (is_string(ret.type)) {
+		if (ret.kind == Expression::Constant && rhs.kind == Expression::Constant) {
+			return constant(holds(jump, text(ret), text(rhs)), BoolType{});
+		}
+		ret = to_register(env, ls, std::move(ret));
+		rhs = to_register(env, ls, std::move(rhs));
+		free_expression(ls, rhs);
+		free_expression(ls, ret);
+
+		/* equality only needs the hashes and sizes of long strings */
+		auto op = jump == JE || jump == JNE ? SEQ : SCMP;
+		ls.fs->ir.EmitABC(op, ret.slot.location, rhs.slot.location, 0);
+		return {Expression::Compare, {-1}, BoolType{}, jump};
+	}
+	if (is_float(ret.type)) {
+		if (ret.kind == Expression::Constant && rhs.kind == Expression::Constant) {
+			return constant(holds(jump, number(ret), number(rhs)), BoolType{});
+		}
+		ret = to_register(env, ls, std::move(ret));
+		rhs = to_register(env, ls, std::move(rhs));
+		free_expression(ls, rhs);
+		free_expression(ls, ret);
+
+		ls.fs->ir.EmitABC(FCMP, ret.slot.location, rhs.slot.location, 0);
+		return {Expression::Compare, {-1}, BoolType{}, jump, false, 0, true};
+	}
+	if (ret.kind == Expression::Constant && rhs.kind == Expression::Constant) {
+		return constant(holds(jump, ret.value, rhs.value), BoolType{});
+	}
+
+	if (ret.kind == Expression::Constant) {
+		std::swap(ret, rhs);
+		jump = mirror(jump);
+	}
+	if (rhs.kind == Expression::Constant && fits_wide_sBx(rhs.value)) {
+		ret = to_register(env, ls, std::move(ret));
+		free_expression(ls, ret);
+
+		ls.fs->ir.CmpIntK(ret.slot.location, rhs.value);
+		return {Expression::Compare, {-1}, BoolType{}, jump};
+	}
+
+	ret = to_register(env, ls, std::move(ret));
+	rhs = to_register(env, ls, std::move(rhs));
+	free_expression(ls, rhs);
+	free_expression(ls, ret);
+
+	ls.fs->ir.CmpInt(ret.slot.location, rhs.slot.location);
+	return {Expression::Compare, {-1}, BoolType{}, jump};
 }
 
 Expression bitwise_and_expression(Environment& env, LexState& ls) {
@@ -221,43 +911,97 @@ Expression logical_or_expression(Environment& env, LexState& ls) {
 }
 
 Expression assignment_expression(Environment& env, LexState& ls) {
-	return logical_or_expression(env, ls);
-//	while (true) {
-//		if (skip(ls, token_type::assign)) {
-//		} else if (skip(ls, token_type::plus_assign)) {
-//		} else if (skip(ls, token_type::minus_assign)) {
-//		} else if (skip(ls, token_type::multiply_assign)) {
-//		} else if (skip(ls, token_type::divide_assign)) {
-//		} else if (skip(ls, token_type::modulo_assign)) {
-//		} else {
-//			break;
-//		}
-//	}
+	auto lhs = logical_or_expression(env, ls);
+
+	OPCODE op;
+	switch (ls.token.type) {
+	case token_type::assign: op = NOP; break;
+	case token_type::plus_assign: op = IADD; break;
+	case token_type::minus_assign: op = ISUB; break;
+	case token_type::multiply_assign: op = IMUL; break;
+	case token_type::divide_assign: op = IDIV; break;
+	case token_type::modulo_assign: op = IMOD; break;
+	default:
+		return lhs;
+	}
+	if ((lhs.kind != Expression::Local && lhs.kind != Expression::Field) || !lhs.is_mutable) {
+		fmt::print("cannot assign to an immutable value\n");
+		abort();
+	}
+	ls.next();
+
+	auto rhs = assignment_expression(env, ls);
+	if (op != NOP) {
+		rhs = arithmetic(env, ls, op, lhs, discharge(env, ls, rhs));
+	}
+	if (!same_type(lhs.type, rhs.type)) {
+		fmt::print("cannot assign a value of a different type\n");
+		abort();
+	}
+	if (lhs.kind == Expression::Field) {
+		store_field(env, ls, lhs.slot, lhs.offset, lhs.type, std::move(rhs));
+	} else if (is_block(lhs.type) && !rhs.fresh) {
+		/* a mutable variable's block is its own, the value is copied into it */
+		rhs = to_register(env, ls, std::move(rhs));
+		ls.fs->ir.EmitABC(SCOPY, lhs.slot.location, rhs.slot.location, as_struct(lhs.type)->size);
+		free_expression(ls, rhs);
+	} else {
+		store(env, ls, rhs, lhs.slot);
+	}
+	return lhs;
 }
 
 Expression expression(Environment& env, LexState &ls) {
 	return assignment_expression(env, ls);
 }
 
+/* batched host calls made in a loop are delivered when it exits */
+static void enter_loop(LexState& ls) {
+	ls.fs->loops.emplace_back();
+}
+
+static void flush_batches(LexState& ls, const std::vector<uint32_t>& batched) {
+	for (auto index : batched) {
+		ls.fs->ir.xFlush(index);
+	}
+}
+
+static void leave_loop(LexState& ls) {
+	flush_batches(ls, ls.fs->loops.back());
+	ls.fs->loops.pop_back();
+}
+
 void while_statement(Environment& env, LexState &ls) {
 	ls.next();
 //
 	enter_scope(env, ls);
+	auto loop = ls.fs->ir.instructions.size();
+
 	consume(ls, token_type::left_paren);
 	auto condition = expression(env, ls);
 	consume(ls, token_type::right_paren);
 
-	auto loop = ls.fs->ir.instructions.size();
+	enter_loop(ls);
+	if (condition.kind == Expression::Constant) {
+		statement_list(env, ls);
+		if (condition.value) {
+			ls.fs->ir.EmitsAx(JMP, loop);
+		} else {
+			ls.fs->ir.instructions.resize(loop);
+		}
+		/* never exits, or never ran, only a return delivers its batches */
+		ls.fs->loops.pop_back();
+		leave_scope(env, ls);
+		return;
+	}
 
-	ls.fs->ir.EmitABC(TEST, condition.slot.location, 0, 0);
-	auto jmp_I = ls.fs->ir.EmitsAx(JE, 0);
+	auto exit = jump_if_false(env, ls, condition);
 
 	statement_list(env, ls);
 
 	ls.fs->ir.EmitsAx(JMP, loop);
-
-	auto& I = ls.fs->ir.instructions[jmp_I];
-	I.sAx = ls.fs->ir.instructions.size();
+	patch(ls, exit);
+	leave_loop(ls);
 
 	leave_scope(env, ls);
 }
@@ -269,9 +1013,11 @@ void loop_statement(Environment& env, LexState &ls) {
 
 	auto loop = ls.fs->ir.instructions.size();
 
+	enter_loop(ls);
 	statement_list(env, ls);
 
 	ls.fs->ir.EmitsAx(JMP, loop);
+	ls.fs->loops.pop_back();
 
 	leave_scope(env, ls);
 }
@@ -284,80 +1030,317 @@ void if_statement(Environment& env, LexState &ls) {
 	auto condition = expression(env, ls);
 	consume(ls, token_type::right_paren);
 
-	ls.fs->ir.EmitABC(TEST, condition.slot.location, 0, 0);
-	auto jmp_I = ls.fs->ir.EmitsAx(JNE, 0);
+	if (condition.kind == Expression::Constant) {
+		/* both branches are parsed, only the taken one is kept */
+		auto start = ls.fs->ir.instructions.size();
+		statement_list(env, ls);
+		if (!condition.value) {
+			ls.fs->ir.instructions.resize(start);
+		}
+		if (skip(ls, token_type::kw_else)) {
+			start = ls.fs->ir.instructions.size();
+			else_statement(env, ls);
+			if (condition.value) {
+				ls.fs->ir.instructions.resize(start);
+			}
+		}
+		leave_scope(env, ls);
+		return;
+	}
 
-	statement_list(env, ls);
+	auto skip_then = jump_if_false(env, ls, condition);
 
-	auto& I = ls.fs->ir.instructions[jmp_I];
-	I.sAx = ls.fs->ir.instructions.size();
+	statement_list(env, ls);
 
 	if (skip(ls, token_type::kw_else)) {
-		statement_list(env, ls);
+		auto skip_else = ls.fs->ir.EmitsAx(JMP, 0);
+		patch(ls, skip_then);
+		else_statement(env, ls);
+		patch(ls, skip_else);
+	} else {
+		patch(ls, skip_then);
 	}
 
 	leave_scope(env, ls);
 }
 
+static void else_statement(Environment& env, LexState &ls) {
+	if (check(ls, token_type::kw_if)) {
+		if_statement(env, ls);
+	} else {
+		statement_list(env, ls);
+	}
+}
+
 void let_statement(Environment& env, LexState &ls) {
 	ls.next();
 
+	auto is_mutable = skip(ls, token_type::kw_mut);
 	auto name = checkname(env, ls);
 
 	consume(ls, token_type::assign);
-	auto temp = expression(env, ls);
+	auto value = expression(env, ls);
 
-	ls.fs->declare(name, temp.slot, temp.type);
+	/* a block must neither change under an immutable binding nor through a mutable one */
+	if (is_block(value.type) && (is_mutable ? !value.fresh : value.is_mutable)) {
+		value = copy_block(env, ls, std::move(value));
+	}
+
+	/* immutable bindings share the slot or the value of what they are bound to */
+	if (value.kind == Expression::Constant && !is_mutable) {
+		declare(ls, *ls.fs, name, {{-1}, value.type, false, value.value});
+		return;
+	}
+	if (value.kind == Expression::Local && !value.is_mutable && !is_mutable) {
+		declare(ls, *ls.fs, name, {value.slot, value.type, is_mutable});
+		return;
+	}
+	if (value.kind == Expression::Temp) {
+		for (uint32_t i = 0; i < registers(value.type); i++) {
+			ls.fs->own({value.slot.location + int(i)});
+		}
+		declare(ls, *ls.fs, name, {value.slot, value.type, is_mutable});
+		return;
+	}
+
+	auto slot = ls.fs->allocate(registers(value.type));
+	for (uint32_t i = 0; i < registers(value.type); i++) {
+		ls.fs->own({slot.location + int(i)});
+	}
+	store(env, ls, value, slot);
+	declare(ls, *ls.fs, name, {slot, value.type, is_mutable});
 }
 
 Type parsetype(Environment& env, LexState &ls) {
-	consume(ls, token_type::identifier);
-	return IntType{};
+	auto name = ls.symbols.name(checkname(env, ls));
+	if (name == "int") {
+		return IntType{};
+	}
+	if (name == "float") {
+		return FloatType{};
+	}
+	if (name == "bool") {
+		return BoolType{};
+	}
+	if (name == "string") {
+		return StringType{};
+	}
+	if (auto type = env.find_struct(name)) {
+		return type;
+	}
+	fmt::print("unknown type '{}'\n", name);
+	abort();
+}
+
+/* fn name(a: int, ...): type, declares the function, its body is compiled later */
+static void fn_signature(Environment& env, LexState &ls) {
+	ls.next();
+
+	auto name = ls.symbols.name(checkname(env, ls));
+	auto type = env.function_type(VoidType{});
+
+	auto index = env.function(name);
+	if (env.functions[index].defined) {
+		fmt::print("redefinition of '{}'\n", name);
+		abort();
+	}
+	env.functions[index].type = type;
+	env.functions[index].defined = true;
+
+	consume(ls, token_type::left_paren);
+	if (!check(ls, token_type::right_paren)) {
+		do {
+			checkname(env, ls);
+			consume(ls, token_type::colon);
+			type->args.emplace_back(parsetype(env, ls));
+		} while (skip(ls, token_type::comma));
+	}
+	consume(ls, token_type::right_paren);
+
+	if (skip(ls, token_type::colon)) {
+		type->return_type = parsetype(env, ls);
+	}
 }
 
 void fn_statement(Environment& env, LexState &ls) {
 	ls.next();
 
-	auto name = checkname(env, ls);
-	auto type = new FunctionType{};
+	auto name = ls.symbols.name(checkname(env, ls));
+	auto index = env.function_index.find(name)->second;
+	auto type = env.functions[index].type;
 
 	FuncState new_fs{};
 	new_fs.name = name;
-	auto fs = enter_func(env, ls, new_fs);
+	new_fs.index = index;
+	enter_func(env, ls, new_fs);
 
+	/* the types were read by fn_signature(), the names are declared here */
 	consume(ls, token_type::left_paren);
 	if (!check(ls, token_type::right_paren)) {
 		do {
 			auto arg_name = checkname(env, ls);
 			consume(ls, token_type::colon);
-			auto arg_type = parsetype(env, ls);
-
-			new_fs.declare(arg_name, new_fs.allocate(), arg_type);
-			new_fs.args.emplace_back(arg_name);
+			parsetype(env, ls);
 
-			type->args.emplace_back(std::move(arg_type));
+			auto const& arg_type = type->args[new_fs.args.size()];
+			declare(ls, new_fs, arg_name, {new_fs.allocate(registers(arg_type)), arg_type});
+			new_fs.args.emplace_back(ls.symbols.name(arg_name));
 		} while (skip(ls, token_type::comma));
 	}
 	consume(ls, token_type::right_paren);
 
 	if (skip(ls, token_type::colon)) {
-		type->return_type = parsetype(env, ls);
-	} else {
-		type->return_type = VoidType{};
+		parsetype(env, ls);
 	}
-//	auto alloc = fs->allocate();
-//	fs->declare(name, alloc, type);
 	statement_list(env, ls);
 	leave_func(env, ls);
 }
 
+/*
+ * extern fn name(a: int, ...): type
+ *
+ * States the signature the script expects of a host function, which must
+ * be declared with Environment::native before compiling.
+ */
+void extern_statement(Environment& env, LexState &ls) {
+	ls.next();
+	consume(ls, token_type::kw_fn);
+
+	auto name = ls.symbols.name(checkname(env, ls));
+	auto const* host = env.find(name);
+	if (host == nullptr || host->native == nullptr) {
+		fmt::print("'{}' is not provided by the host\n", name);
+		abort();
+	}
+
+	FunctionType type{VoidType{}, {}};
+	consume(ls, token_type::left_paren);
+	if (!check(ls, token_type::right_paren)) {
+		do {
+			checkname(env, ls);
+			consume(ls, token_type::colon);
+			type.args.emplace_back(parsetype(env, ls));
+		} while (skip(ls, token_type::comma));
+	}
+	consume(ls, token_type::right_paren);
+	if (skip(ls, token_type::colon)) {
+		type.return_type = parsetype(env, ls);
+	}
+
+	bool matches = same_type(type.return_type, host->type->return_type) && type.args.size() == host->type->args.size();
+	for (size_t i = 0; matches && i < type.args.size(); i++) {
+		matches = same_type(type.args[i], host->type->args[i]);
+	}
+	if (!matches) {
+		fmt::print("'{}' does not match the host's signature '{}'\n", name, host->signature->code);
+		abort();
+	}
+}
+
+/*
+ * struct Name { field: type, ... }
+ *
+ * Struct types are global to the Environment, a struct field is laid out
+ * inline, so a struct cannot contain itself.
+ */
+static void struct_declaration(Environment& env, LexState &ls) {
+	ls.next();
+
+	auto name = ls.symbols.name(checkname(env, ls));
+	if (env.find_struct(name)) {
+		fmt::print("redefinition of '{}'\n", name);
+		abort();
+	}
+
+	StructType type;
+	type.name = std::string(name);
+	consume(ls, token_type::left_curve);
+	while (!check(ls, token_type::right_curve)) {
+		auto field = ls.symbols.name(checkname(env, ls));
+		if (type.field(field) >= 0) {
+			fmt::print("'{}' has two fields called '{}'\n", name, field);
+			abort();
+		}
+		consume(ls, token_type::colon);
+		auto field_type = parsetype(env, ls);
+		if (slots(field_type) > StructType::MAX_SLOTS - type.size) {
+			fmt::print("'{}' is larger than {} slots\n", name, StructType::MAX_SLOTS);
+			abort();
+		}
+
+		if (auto nested = as_struct(field_type)) {
+			for (auto slot : nested->strings) {
+				type.strings.push_back(type.size + slot);
+			}
+		} else if (is_string(field_type)) {
+			type.strings.push_back(type.size);
+		}
+		type.names.emplace_back(field);
+		type.offsets.push_back(type.size);
+		type.size += slots(field_type);
+		type.fields.push_back(std::move(field_type));
+
+		if (!skip(ls, token_type::comma)) {
+			break;
+		}
+	}
+	consume(ls, token_type::right_curve);
+
+	if (type.fields.empty()) {
+		fmt::print("'{}' has no fields\n", name);
+		abort();
+	}
+	auto& s = env.structs.emplace_back(std::move(type));
+	env.struct_index.emplace(s.name, &s);
+}
+
+/* struct_declaration() has already declared it */
+void struct_statement(Environment& env, LexState &ls) {
+	ls.next();
+	checkname(env, ls);
+	while (!skip(ls, token_type::right_curve)) {
+		ls.next();
+	}
+}
+
+/* a return leaves every enclosing loop at once */
+static void flush_loops(LexState& ls) {
+	for (auto const& batched : ls.fs->loops) {
+		flush_batches(ls, batched);
+	}
+}
+
 void return_statement(Environment& env, LexState &ls) {
 	ls.next();
-	expression(env, ls);
+	auto const& type = env.functions[ls.fs->index].type->return_type;
+	if (check(ls, token_type::right_curve)) {
+		if (!std::holds_alternative<VoidType>(type)) {
+			fmt::print("'{}' must return a value\n", ls.fs->name);
+			abort();
+		}
+		flush_loops(ls);
+		ls.fs->ir.Ret();
+		return;
+	}
+	auto e = to_register(env, ls, expression(env, ls));
+	if (!same_type(e.type, type)) {
+		fmt::print("'{}' returns a value of the wrong type\n", ls.fs->name);
+		abort();
+	}
+	free_expression(ls, e);
+	flush_loops(ls);
+
+	/* 'return f(...)' reuses the current frame */
+	auto& code = ls.fs->ir.instructions;
+	if (e.kind == Expression::Temp && !code.empty() && code.back().op == CALL && code.back().A == e.slot.location) {
+		ls.fs->ir.TailCall(code.size() - 1);
+		return;
+	}
+	ls.fs->ir.Ret(e.slot.location, registers(e.type));
 }
 
 void expression_statement(Environment& env, LexState &ls) {
-	expression(env, ls);
+	free_expression(ls, expression(env, ls));
 }
 
 void block_statement(Environment& env, LexState &ls) {
@@ -382,6 +1365,10 @@ void statement(Environment& env, LexState &ls) {
 		return if_statement(env, ls);
 	case token_type::kw_fn:
 		return fn_statement(env, ls);
+	case token_type::kw_extern:
+		return extern_statement(env, ls);
+	case token_type::kw_struct:
+		return struct_statement(env, ls);
 	case token_type::kw_let:
 		return let_statement(env, ls);
 	case token_type::kw_return:
@@ -454,21 +1441,51 @@ void statement_list(Environment& env, LexState &ls) {
 }
 
 
-void parse(Environment& env, std::string_view src) {
+/*
+ * Declares every struct and function signature in 'src' before any body is
+ * compiled, so a call may come before the function it calls and is still
+ * checked against its signature. Declarations are global wherever they are
+ * nested, a struct must still come before the signatures that use it.
+ */
+static void declare_signatures(Environment& env, std::string_view src) {
 	LexState ls{src};
 	ls.next();
+	while (!check(ls, token_type::end_of_source)) {
+		if (check(ls, token_type::kw_struct)) {
+			struct_declaration(env, ls);
+		} else if (skip(ls, token_type::kw_extern)) {
+			/* the host declared it */
+			skip(ls, token_type::kw_fn);
+		} else if (check(ls, token_type::kw_fn)) {
+			fn_signature(env, ls);
+		} else {
+			ls.next();
+		}
+	}
+}
 
+Module compile(Environment& env, std::string_view src, std::string_view name) {
 	FuncState fs{};
-	fs.name = "main";
+	fs.name = name;
+	fs.index = env.function(fs.name);
+	if (env.functions[fs.index].defined) {
+		fmt::print("redefinition of '{}'\n", name);
+		abort();
+	}
+	env.functions[fs.index].type = env.function_type(VoidType{});
+	env.functions[fs.index].defined = true;
+
+	declare_signatures(env, src);
 
+	LexState ls{src};
+	ls.next();
 	enter_func(env, ls, fs);
-	
+
 	while (ls.token.type != token_type::end_of_source) {
 		statement(env, ls);
 	}
 	expect(ls, token_type::end_of_source);
 	leave_func(env, ls);
 
-	VM vm;
-	vm.call(fs);
+	return {&env, &env.functions[fs.index]};
 }
\ No newline at end of file
@@ -1,111 +1,600 @@
 #include "vm.hpp"
 
-VM::VM() {
-	dc = dcNewCallVM(4096);
-}
+#include <algorithm>
+#include <cstring>
+
+/*
+ * Instruction dispatch. With L_COMPUTED_GOTO every handler ends with its own
+ * indirect jump through a label table (direct threading), so the branch
+ * predictor sees one branch per opcode instead of a single shared one.
+ * Otherwise the loop falls back to a portable switch.
+ */
+#if !defined(L_COMPUTED_GOTO)
+#if defined(__GNUC__)
+#define L_COMPUTED_GOTO 1
+#else
+#define L_COMPUTED_GOTO 0
+#endif
+#endif
+
+#if L_COMPUTED_GOTO
+#define vmdispatch(I)	goto *(I)->handler;
+#define vmcase(l)		L_##l:
+#define vmbreak			I = pc++; vmdispatch(I)
+#define vmdefault
+#else
+#define vmdispatch(I)	switch ((I)->op)
+#define vmcase(l)		case l:
+#define vmbreak			break
+#define vmdefault		default:
+#endif
 
 VM::~VM() {
-	dcFree(dc);
+	if (dc != nullptr) {
+		dcFree(dc);
+	}
+}
+
+Value* VM::grow(Value* sp, size_t size) {
+	auto base = size_t(sp - stack.data());
+	auto top = base + size;
+	if (top > MAX_STACK) {
+		fmt::print("stack overflow\n");
+		exit(1);
+	}
+	stack.resize(std::clamp(stack.size() * 2, std::max(top, MIN_STACK), MAX_STACK));
+	return stack.data() + base;
+}
+
+DCCallVM* VM::ffi() {
+	if (dc == nullptr) {
+		dc = dcNewCallVM(4096);
+	}
+	return dc;
+}
+
+Batch& VM::attach(const Function& fn) {
+	if (fn.batch_index >= batches.size()) {
+		batches.resize(fn.batch_index + 1);
+	}
+	/* another Environment's function may have had the slot */
+	auto& batch = batches[fn.batch_index];
+	flush(batch);
+	batch.fn = &fn;
+	batch.records.resize(size_t(fn.batch_capacity) * fn.signature->args().size());
+	return batch;
+}
+
+void VM::flush(Batch& batch) {
+	if (batch.size == 0) {
+		return;
+	}
+	auto width = batch.fn->signature->args().size();
+	reinterpret_cast<BatchFunction>(batch.fn->native)(batch.records.data(), batch.size / width);
+	batch.size = 0;
 }
 
-void VM::call(FuncState &fs) {
-	std::span instructions = fs.ir.instructions;
-	sp -= fs.stack_size;
-	ip = 0;
+/* done at function entry, so the body itself never checks the stack */
+#define checkstack(n) \
+	if (sp + (n) > vm->stack.data() + vm->stack.size()) { \
+		sp = vm->grow(sp, n); \
+	} \
+	vm->high_water = std::max(vm->high_water, size_t(sp + (n) - vm->stack.data()));
+
+/* host calls with a result, which lands in A like a CALL's */
+#define xcall(field, dccall) { \
+		auto callee = I->callee; \
+		if (callee->signature->trampoline) { \
+			sp[I->A] = callee->signature->trampoline(callee->native, sp + I->A); \
+		} else { \
+			ffi_push(vm->ffi(), *callee->signature, sp + I->A); \
+			sp[I->A].field = dccall(vm->dc, callee->native); \
+		} \
+	}
+
+/*
+ * Runs linked code until the RET of the entry frame. Called with a null 'pc'
+ * it only returns the handler table, which link() uses to resolve
+ * LinkedInstruction::handler.
+ *
+ * 'sp' is the base of the current register window. CALL A moves the window
+ * up by A registers, so the callee's parameters are the caller's registers
+ * A, A+1, ... and its register 0 is where the caller expects the result.
+ */
+static const void* const* execute(VM* vm, const LinkedInstruction* pc, Value* sp) {
+#if L_COMPUTED_GOTO
+	static const void* const handlers[NUM_OPCODES] = {
+		&&L_NOP,
+		&&L_LOAD,
+		&&L_ISTORE,
+		&&L_LOADK,
+		&&L_IADD,
+		&&L_ISUB,
+		&&L_IMUL,
+		&&L_IDIV,
+		&&L_IMOD,
+		&&L_INEG,
+		&&L_ICMP,
+		&&L_TEST,
+		&&L_FADD,
+		&&L_FSUB,
+		&&L_FMUL,
+		&&L_FDIV,
+		&&L_FNEG,
+		&&L_FCMP,
+		&&L_NOT,
+		&&L_CONCAT,
+		&&L_SLEN,
+		&&L_SEQ,
+		&&L_SCMP,
+		&&L_NEWSTRUCT,
+		&&L_GETFIELD,
+		&&L_SETFIELD,
+		&&L_FIELDPTR,
+		&&L_SCOPY,
+		&&L_JMP,
+		&&L_JE,
+		&&L_JNE,
+		&&L_JLT,
+		&&L_JLE,
+		&&L_JGT,
+		&&L_JGE,
+		&&L_IADDK,
+		&&L_ISUBK,
+		&&L_IMULK,
+		&&L_IDIVK,
+		&&L_IMODK,
+		&&L_ICMPK,
+		&&L_BEQ,
+		&&L_BNE,
+		&&L_BLT,
+		&&L_BLE,
+		&&L_BGT,
+		&&L_BGE,
+		&&L_BEQK,
+		&&L_BNEK,
+		&&L_BLTK,
+		&&L_BLEK,
+		&&L_BGTK,
+		&&L_BGEK,
+		&&L_BZ,
+		&&L_BNZ,
+		&&L_CALL,
+		&&L_TAILCALL,
+		&&L_xCALLv,
+		&&L_xCALLi,
+		&&L_xCALLl,
+		&&L_xCALLd,
+		&&L_xCALLp,
+		&&L_xBATCH,
+		&&L_xFLUSH,
+		&&L_RET,
+		&&L_WIDE,
+	};
+#else
+	static const void* const* handlers = nullptr;
+#endif
+
+	if (pc == nullptr) {
+		return handlers;
+	}
+
+	auto flag = std::partial_ordering::unordered;
+	auto depth = vm->frames.size();
 
 	while (true) {
-		auto I = instructions[ip++];
-		switch (I.op) {
-		case NOP:
-			break;
-		case LOAD:
-			sp[I.A] = sp[I.B];
-			break;
+		auto I = pc++;
+		vmdispatch(I) {
+		vmcase(NOP)
+			vmbreak;
+		vmcase(LOAD)
+			sp[I->A] = sp[I->B];
+			vmbreak;
+		vmcase(ISTORE)
+			sp[I->A].i64 = I->K;
+			vmbreak;
+		vmcase(LOADK)
+			sp[I->A].i64 = I->K;
+			vmbreak;
+		vmcase(IADD)
+			sp[I->A].i64 = sp[I->B].i64 + sp[I->C].i64;
+			vmbreak;
+		vmcase(ISUB)
+			sp[I->A].i64 = sp[I->B].i64 - sp[I->C].i64;
+			vmbreak;
+		vmcase(IMUL)
+			sp[I->A].i64 = sp[I->B].i64 * sp[I->C].i64;
+			vmbreak;
+		vmcase(IDIV)
+			sp[I->A].i64 = sp[I->B].i64 / sp[I->C].i64;
+			vmbreak;
+		vmcase(IMOD)
+			sp[I->A].i64 = sp[I->B].i64 % sp[I->C].i64;
+			vmbreak;
+		vmcase(INEG)
+			sp[I->A].i64 = -sp[I->B].i64;
+			vmbreak;
+		vmcase(ICMP)
+			flag = sp[I->A].i64 <=> sp[I->B].i64;
+			vmbreak;
+		vmcase(TEST)
+			flag = sp[I->A].i64 <=> 0;
+			vmbreak;
+		vmcase(FADD)
+			sp[I->A].f64 = sp[I->B].f64 + sp[I->C].f64;
+			vmbreak;
+		vmcase(FSUB)
+			sp[I->A].f64 = sp[I->B].f64 - sp[I->C].f64;
+			vmbreak;
+		vmcase(FMUL)
+			sp[I->A].f64 = sp[I->B].f64 * sp[I->C].f64;
+			vmbreak;
+		vmcase(FDIV)
+			sp[I->A].f64 = sp[I->B].f64 / sp[I->C].f64;
+			vmbreak;
+		vmcase(FNEG)
+			sp[I->A].f64 = -sp[I->B].f64;
+			vmbreak;
+		vmcase(FCMP)
+			flag = sp[I->A].f64 <=> sp[I->B].f64;
+			vmbreak;
+		vmcase(NOT)
+			sp[I->A].i64 = sp[I->B].i64 == 0;
+			vmbreak;
+		vmcase(CONCAT)
+			sp[I->A].u64 = string_concat(vm->heap, sp[I->B].u64, sp[I->C].u64);
+			vmbreak;
+		vmcase(SLEN)
+			sp[I->A].i64 = int64_t(string_size(sp[I->B].u64));
+			vmbreak;
+		vmcase(SEQ)
+			flag = string_equal(sp[I->A].u64, sp[I->B].u64) ? std::partial_ordering::equivalent : std::partial_ordering::unordered;
+			vmbreak;
+		vmcase(SCMP)
+			flag = string_compare(sp[I->A].u64, sp[I->B].u64);
+			vmbreak;
+		vmcase(NEWSTRUCT)
+			sp[I->A].p = vm->heap.allocate(size_t(I->B) * sizeof(Value));
+			vmbreak;
+		vmcase(GETFIELD)
+			sp[I->A] = static_cast<Value*>(sp[I->B].p)[I->C];
+			vmbreak;
+		vmcase(SETFIELD)
+			static_cast<Value*>(sp[I->A].p)[I->B] = sp[I->C];
+			vmbreak;
+		vmcase(FIELDPTR)
+			sp[I->A].p = static_cast<Value*>(sp[I->B].p) + I->C;
+			vmbreak;
+		vmcase(SCOPY)
+			std::memmove(sp[I->A].p, sp[I->B].p, size_t(I->C) * sizeof(Value));
+			vmbreak;
+		vmcase(JMP)
+			pc += I->K;
+			vmbreak;
+		vmcase(JE)
+			pc += std::is_eq(flag) ? I->K : 0;
+			vmbreak;
+		vmcase(JNE)
+			pc += std::is_neq(flag) ? I->K : 0;
+			vmbreak;
+		vmcase(JLT)
+			pc += std::is_lt(flag) ? I->K : 0;
+			vmbreak;
+		vmcase(JLE)
+			pc += std::is_lteq(flag) ? I->K : 0;
+			vmbreak;
+		vmcase(JGT)
+			pc += std::is_gt(flag) ? I->K : 0;
+			vmbreak;
+		vmcase(JGE)
+			pc += std::is_gteq(flag) ? I->K : 0;
+			vmbreak;
+		vmcase(IADDK)
+			sp[I->A].i64 = sp[I->B].i64 + I->C;
+			vmbreak;
+		vmcase(ISUBK)
+			sp[I->A].i64 = sp[I->B].i64 - I->C;
+			vmbreak;
+		vmcase(IMULK)
+			sp[I->A].i64 = sp[I->B].i64 * I->C;
+			vmbreak;
+		vmcase(IDIVK)
+			sp[I->A].i64 = sp[I->B].i64 / I->C;
+			vmbreak;
+		vmcase(IMODK)
+			sp[I->A].i64 = sp[I->B].i64 % I->C;
+			vmbreak;
+		vmcase(ICMPK)
+			flag = sp[I->A].i64 <=> I->C;
+			vmbreak;
+		vmcase(BEQ)
+			pc += sp[I->A].i64 == sp[I->B].i64 ? I->K : 0;
+			vmbreak;
+		vmcase(BNE)
+			pc += sp[I->A].i64 != sp[I->B].i64 ? I->K : 0;
+			vmbreak;
+		vmcase(BLT)
+			pc += sp[I->A].i64 < sp[I->B].i64 ? I->K : 0;
+			vmbreak;
+		vmcase(BLE)
+			pc += sp[I->A].i64 <= sp[I->B].i64 ? I->K : 0;
+			vmbreak;
+		vmcase(BGT)
+			pc += sp[I->A].i64 > sp[I->B].i64 ? I->K : 0;
+			vmbreak;
+		vmcase(BGE)
+			pc += sp[I->A].i64 >= sp[I->B].i64 ? I->K : 0;
+			vmbreak;
+		vmcase(BEQK)
+			pc += sp[I->A].i64 == I->C ? I->K : 0;
+			vmbreak;
+		vmcase(BNEK)
+			pc += sp[I->A].i64 != I->C ? I->K : 0;
+			vmbreak;
+		vmcase(BLTK)
+			pc += sp[I->A].i64 < I->C ? I->K : 0;
+			vmbreak;
+		vmcase(BLEK)
+			pc += sp[I->A].i64 <= I->C ? I->K : 0;
+			vmbreak;
+		vmcase(BGTK)
+			pc += sp[I->A].i64 > I->C ? I->K : 0;
+			vmbreak;
+		vmcase(BGEK)
+			pc += sp[I->A].i64 >= I->C ? I->K : 0;
+			vmbreak;
+		vmcase(BZ)
+			pc += sp[I->A].i64 == 0 ? I->K : 0;
+			vmbreak;
+		vmcase(BNZ)
+			pc += sp[I->A].i64 != 0 ? I->K : 0;
+			vmbreak;
+		vmcase(CALL) {
+			auto callee = I->callee;
+			vm->frames.push_back({pc, size_t(sp - vm->stack.data())});
+			sp += I->A;
+			checkstack(callee->stack_size);
+			pc = callee->code.data();
+			vmbreak;
+		}
+		vmcase(TAILCALL) {
+			auto callee = I->callee;
+			checkstack(callee->stack_size);
+			std::copy_n(sp + I->A, I->B, sp);
+			pc = callee->code.data();
+			vmbreak;
+		}
+		vmcase(xCALLv) {
+			auto callee = I->callee;
+			if (callee->signature->trampoline) {
+				callee->signature->trampoline(callee->native, sp + I->A);
+			} else {
+				ffi_push(vm->ffi(), *callee->signature, sp + I->A);
+				dcCallVoid(vm->dc, callee->native);
+			}
+			vmbreak;
+		}
+		vmcase(xCALLi)
+			xcall(i64, dcCallInt);
+			vmbreak;
+		vmcase(xCALLl)
+			xcall(i64, dcCallLongLong);
+			vmbreak;
+		vmcase(xCALLd)
+			xcall(f64, dcCallDouble);
+			vmbreak;
+		vmcase(xCALLp)
+			xcall(p, dcCallPointer);
+			vmbreak;
+		vmcase(xBATCH) {
+			auto& batch = vm->batch(*I->callee);
+			auto record = batch.records.data() + batch.size;
+			for (int32_t i = 0; i < I->B; i++) {
+				record[i] = sp[I->A + i];
+			}
+			batch.size += I->B;
+			if (batch.size == batch.records.size()) {
+				vm->flush(batch);
+			}
+			vmbreak;
+		}
+		vmcase(xFLUSH)
+			vm->flush(vm->batch(*I->callee));
+			vmbreak;
+		vmcase(RET) {
+			std::copy_n(sp + I->A, I->B, sp);
+			if (vm->frames.size() == depth) {
+				return nullptr;
+			}
+			auto frame = vm->frames.back();
+			vm->frames.pop_back();
+			pc = frame.ip;
+			sp = vm->stack.data() + frame.base;
+			vmbreak;
+		}
+		vmcase(WIDE)
+		vmdefault
+			fmt::print("illegal instruction '{}'\n", int(I->op));
+			exit(1);
+		}
+	}
+}
+
+static bool is_branch(uint8_t op) {
+	return op >= BEQ && op <= BNZ;
+}
+
+void link(Function& fn, const Environment& env) {
+	link(fn, fn.ir, env);
+}
+
+void link(Function& fn, const BytecodeView& ir, const Environment& env) {
+	auto handlers = execute(nullptr, nullptr, nullptr);
+	auto const& instructions = ir.instructions;
+
+	/* fused branches absorb the JMP that follows them, instructions the WIDE word before them */
+	std::vector<int64_t> remap(instructions.size() + 1);
+	int64_t count = 0;
+	for (size_t pc = 0; pc < instructions.size(); pc++) {
+		remap[pc] = count;
+		if (instructions[pc].op != WIDE && (pc == 0 || !is_branch(instructions[pc - 1].op))) {
+			count++;
+		}
+	}
+	remap[instructions.size()] = count;
+
+	fn.code.clear();
+	fn.code.reserve(count);
+
+	for (size_t pc = 0; pc < instructions.size(); pc++) {
+		if (instructions[pc].op == WIDE) {
+			continue;
+		}
+		auto I = decode(instructions, pc);
+		if (I.op >= NUM_OPCODES) {
+			fmt::print("illegal instruction '{}' at {}\n", int(I.op), pc);
+			exit(1);
+		}
+
+		auto& L = fn.code.emplace_back();
+		L.handler = handlers ? handlers[I.op] : nullptr;
+		L.op = OPCODE(I.op);
+
+		switch (L.op) {
 		case ISTORE:
-			sp[I.A].i64 = I.Bx;
-			break;
-		case IADD:
-			sp[I.A].i64 = sp[I.B].i64 + sp[I.C].i64;
-			break;
-		case ISUB:
-			sp[I.A].i64 = sp[I.B].i64 - sp[I.C].i64;
+			L.A = I.A;
+			L.K = I.sBx;
 			break;
-		case IMUL:
-			sp[I.A].i64 = sp[I.B].i64 * sp[I.C].i64;
-			break;
-		case IDIV:
-			sp[I.A].i64 = sp[I.B].i64 / sp[I.C].i64;
-			break;
-		case IMOD:
-			sp[I.A].i64 = sp[I.B].i64 % sp[I.C].i64;
-			break;
-		case ICMP:
-			cmp_flag = sp[I.A].i64 <=> sp[I.B].i64;
-			break;
-		case TEST:
-			cmp_flag = sp[I.A].i64 <=> 0;
+		case LOADK:
+			L.A = I.A;
+			L.K = env.constants[I.Bx];
 			break;
 		case JMP:
-			ip = I.sAx;
-			break;
 		case JE:
-			ip = std::is_eq(cmp_flag) ? I.sAx : ip;
-			break;
 		case JNE:
-			ip = std::is_neq(cmp_flag) ? I.sAx : ip;
-			break;
 		case JLT:
-			ip = std::is_lt(cmp_flag) ? I.sAx : ip;
-			break;
 		case JLE:
-			ip = std::is_lteq(cmp_flag) ? I.sAx : ip;
-			break;
 		case JGT:
-			ip = std::is_gt(cmp_flag) ? I.sAx : ip;
-			break;
 		case JGE:
-			ip = std::is_gteq(cmp_flag) ? I.sAx : ip;
-			break;
-		case CALL:
-			break;
-		case xCALLv:
-			dcCallVoid(dc, (DCpointer) sp[I.A].p);
-			dcReset(dc);
-			break;
-		case xPUSHb:
-			dcArgBool(dc, (bool) sp[I.A].i64);
-			break;
-		case xPUSHc:
-			dcArgChar(dc, sp[I.A].i64);
+			L.K = remap[I.sAx] - (remap[pc] + 1);
 			break;
-		case xPUSHs:
-			dcArgShort(dc, sp[I.A].i64);
+		case IADDK:
+		case ISUBK:
+		case IMULK:
+		case IDIVK:
+		case IMODK:
+			L.A = I.A;
+			L.B = I.B;
+			L.C = I.sC;
 			break;
-		case xPUSHi:
-			dcArgInt(dc, sp[I.A].i64);
+		case ICMPK:
+			L.A = I.A;
+			L.C = I.sBx;
 			break;
-		case xPUSHl:
-			dcArgLong(dc, sp[I.A].i64);
-			break;
-		case xPUSHll:
-			dcArgLongLong(dc, sp[I.A].i64);
-			break;
-		case xPUSHf:
-			dcArgFloat(dc, sp[I.A].f64);
-			break;
-		case xPUSHd:
-			dcArgDouble(dc, sp[I.A].f64);
+		case CALL:
+		case TAILCALL:
+		case xCALLv:
+		case xCALLi:
+		case xCALLl:
+		case xCALLd:
+		case xCALLp:
+		case xBATCH:
+		case xFLUSH:
+			L.A = I.A;
+			L.B = I.B;
+			L.callee = &env.functions[ir.callees[I.C]];
 			break;
-		case xPUSHp:
-			dcArgPointer(dc, (DCpointer) sp[I.A].p);
+		case BEQ:
+		case BNE:
+		case BLT:
+		case BLE:
+		case BGT:
+		case BGE:
+		case BEQK:
+		case BNEK:
+		case BLTK:
+		case BLEK:
+		case BGTK:
+		case BGEK:
+		case BZ:
+		case BNZ:
+			L.A = I.A;
+			L.B = I.B;
+			L.C = I.sBx;
+			L.K = remap[instructions[pc + 1].sAx] - (remap[pc] + 1);
+			pc++;
 			break;
-		case RET:
-			return;
 		default:
-			fmt::print("illegal instruction '{}", OPCODE(I.op));
-			exit(1);
+			L.A = I.A;
+			L.B = I.B;
+			L.C = I.C;
+			break;
+		}
+	}
+}
+
+Value VM::call(const Function& fn, std::span<const Value> args) {
+	auto size = std::max<size_t>({size_t(fn.stack_size), args.size(), 1});
+	if (stack.size() < size) {
+		grow(stack.data(), size);
+	}
+	high_water = std::max(high_water, size);
+
+	std::copy(args.begin(), args.end(), stack.begin());
+	execute(this, fn.code.data(), stack.data());
+
+	/* nothing is left behind for a later call to deliver */
+	for (auto& batch : batches) {
+		flush(batch);
+	}
+
+	/*
+	 * Which slots hold strings and whether the result is a heap block is
+	 * read off the declared return type. The compiler makes the code agree
+	 * with it, and loaded code is trusted to, like it is for every other
+	 * value (see cache.hpp).
+	 */
+	static constexpr uint32_t only_slot[] = {0};
+	auto type = fn.type != nullptr ? fn.type->return_type : Type{};
+	auto s = as_struct(type);
+	std::span<const uint32_t> strings;
+	if (s != nullptr) {
+		strings = s->strings;
+	} else if (std::holds_alternative<StringType>(type)) {
+		strings = only_slot;
+	}
+	auto block = s != nullptr && !s->in_registers();
+	auto slots = block ? static_cast<const Value*>(stack[0].p) : stack.data();
+
+	/* a result in registers without long strings needs nothing from the heap */
+	if (!block && std::all_of(strings.begin(), strings.end(), [&](uint32_t i) { return is_inline_string(slots[i].u64); })) {
+		heap.reset();
+		return stack[0];
+	}
+
+	/* the result's slots and the text of its long strings outlive the reset in copies */
+	std::vector<Value> result(slots, slots + (s ? s->size : 1));
+	std::vector<std::pair<uint32_t, size_t>> bodies;
+	std::string text;
+	for (auto i : strings) {
+		if (!is_inline_string(result[i].u64)) {
+			auto view = string_view(result[i].u64);
+			bodies.emplace_back(i, view.size());
+			text.append(view);
 		}
 	}
 
-	sp += fs.stack_size;
+	heap.reset();
+	size_t offset = 0;
+	for (auto [i, length] : bodies) {
+		result[i].u64 = make_string(heap, std::string_view(text).substr(offset, length));
+		offset += length;
+	}
+	if (block) {
+		auto copy = reinterpret_cast<Value*>(heap.allocate(result.size() * sizeof(Value)));
+		std::copy(result.begin(), result.end(), copy);
+		return {.p = copy};
+	}
+	std::copy(result.begin(), result.end(), stack.begin());
+	return stack[0];
 }
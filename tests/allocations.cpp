@@ -0,0 +1,132 @@
+#include "check.hpp"
+#include "lex.h"
+
+#include <cstdlib>
+#include <new>
+#include <string>
+
+/*
+ * Tokens view the source and identifiers are interned, so lexing allocates
+ * only while the symbol table grows, and compiling a statement allocates
+ * nothing. What remains is per-function state. Calls whose result needs
+ * nothing from the VM heap allocate nothing either.
+ */
+
+static size_t allocations = 0;
+static bool counting = false;
+
+void* operator new(size_t size) {
+	if (counting) {
+		allocations++;
+	}
+	if (auto p = std::malloc(size)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	std::free(p);
+}
+
+/* 'functions' functions of 'statements' statements each */
+static std::string generate(int functions, int statements) {
+	std::string src;
+	for (int i = 0; i < functions; i++) {
+		src += "fn function_number_" + std::to_string(i) + "(argument_a: int, argument_b: int): int {\n";
+		src += "\tlet mut running_total = argument_a\n";
+		for (int k = 0; k < statements; k++) {
+			src += "\tif (running_total < argument_b) {\n";
+			src += "\t\tlet step = argument_a * 2 + 1\n";
+			src += "\t\trunning_total += step\n";
+			src += "\t}\n";
+		}
+		src += "\treturn running_total\n}\n";
+	}
+	return src;
+}
+
+static size_t count_tokens(std::string_view src) {
+	LexState ls{src};
+	size_t tokens = 0;
+	do {
+		ls.next();
+		tokens++;
+	} while (ls.token.type != token_type::end_of_source);
+	return tokens;
+}
+
+/* allocations compiling 'src' takes */
+static size_t compile_allocations(const std::string& src) {
+	Environment env{};
+	allocations = 0;
+	counting = true;
+	compile(env, src);
+	counting = false;
+	return allocations;
+}
+
+static const char* results = R"(
+	struct Named { id: int, name: string }
+
+	fn word(x: int): string {
+		if (x > 0) {
+			return "abc"
+		}
+		return ""
+	}
+
+	fn named(x: int): Named {
+		return Named { id: x, name: "ab" }
+	}
+
+	fn count(x: int): int {
+		return x + 1
+	}
+)";
+
+/* allocations a call of 'name' takes, once an earlier call has sized the VM */
+static size_t call_allocations(VM& vm, const Module& module, std::string_view name) {
+	auto fn = module.function(name);
+	Value arg{.i64 = 1};
+	vm.call(*fn, {&arg, 1});
+	allocations = 0;
+	counting = true;
+	vm.call(*fn, {&arg, 1});
+	counting = false;
+	return allocations;
+}
+
+int main() {
+	/* names repeat, the symbol table stops growing */
+	auto src = generate(1, 20000);
+	allocations = 0;
+	counting = true;
+	auto tokens = count_tokens(src);
+	counting = false;
+	check(allocations <= 16, "lexing {} tokens took {} allocations", tokens, allocations);
+
+	auto count = compile_allocations(src);
+	check(count * 1000 < tokens, "compiling {} tokens took {} allocations", tokens, count);
+
+	/* per function there is a bounded number, which grows with the log of its size as vectors do */
+	src = generate(1000, 100);
+	tokens = count_tokens(src);
+	count = compile_allocations(src);
+	check(count < 100 * 1000, "compiling 1000 functions took {} allocations", count);
+	check(count * 20 < tokens, "compiling {} tokens took {} allocations", tokens, count);
+
+	/* inline strings and register structs of them are copied out of the heap as they are */
+	Environment env{};
+	auto module = compile(env, results);
+	VM vm;
+	for (auto name : {"word", "named", "count"}) {
+		count = call_allocations(vm, module, name);
+		check(count == 0, "calling {}() took {} allocations", name, count);
+	}
+	return 0;
+}
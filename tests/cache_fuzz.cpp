@@ -0,0 +1,339 @@
+#include "check.hpp"
+#include "cache.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * A bytecode file that loads must be safe to run. A saved file is mutated
+ * by flipping bits, overwriting bytes and cutting off its end, and each
+ * mutant is loaded in a child process which, if the load succeeds, runs
+ * every function. The child may stop with a runtime error or be killed by
+ * a timer for looping forever, it must never crash.
+ *
+ * Loading trusts the file for the types of values (see cache.hpp), so only
+ * mutants that keep every opcode and function type are run, and the script
+ * works on integers only: a mixed up register holds a wrong number, never a
+ * wrong pointer. Scripts that hold strings or structs are mutated the same
+ * way but only loaded, which must not crash or leak either.
+ */
+
+/* under AddressSanitizer a report, leaks included, must not look like a runtime error */
+extern "C" const char* __asan_default_options() {
+	return "exitcode=86";
+}
+
+/* mutants pass any number, these wrap as the VM's arithmetic does */
+static int64_t combine(int64_t a, int64_t b) {
+	return int64_t(uint64_t(a) * 31 + uint64_t(b));
+}
+
+static int64_t twice(int64_t a) {
+	return int64_t(uint64_t(a) * 2);
+}
+
+static void note(int64_t) {
+}
+
+static void record(const Value*, size_t) {
+}
+
+static const char* source = R"(
+	fn fib(n: int): int {
+		if (n < 2) {
+			return n
+		}
+		return fib(n - 1) + fib(n - 2)
+	}
+
+	fn mix(a: int, b: int): int {
+		let mut s = 0
+		let mut i = 0
+		while (i < a) {
+			s = combine(s, i * b)
+			note(s)
+			record(s, i)
+			i += 1
+		}
+		return twice(s) + fib(b)
+	}
+
+	fn pick(a: int, b: int, c: int): int {
+		if (a > b) {
+			return mix(a, c)
+		} else if (b > c) {
+			return pick(c, a, b)
+		}
+		return a + b * c
+	}
+)";
+
+/* constants of every kind: short and long strings, shared literals, floats and wide ints */
+static const char* strings_source = R"(
+	fn greet(name: string): string {
+		return "hello, " .. name .. ", a long enough greeting"
+	}
+
+	fn same(a: string): int {
+		if (a == "a long enough greeting") {
+			return 1
+		} else if (a == "short") {
+			return 2
+		}
+		return #a
+	}
+
+	fn scale(x: float): float {
+		return x * 2.5 + 9000000000000.0
+	}
+
+	fn wide(a: int): int {
+		return a + 123456789012 + #"a long enough greeting"
+	}
+)";
+
+/* structs in registers and in heap blocks, nested, behind int signatures a file can hold */
+static const char* structs_source = R"(
+	struct Vec { x: int, y: int }
+	struct Wide { a: int, b: int, c: int, d: int, e: int }
+	struct Holder { tag: int, pos: Vec, wide: Wide, name: string }
+
+	fn holder(a: int): int {
+		let mut h = Holder { tag: a, pos: Vec { x: a, y: 2 }, wide: Wide { a: 1, b: 2, c: 3, d: 4, e: a }, name: "a long enough name" }
+		let w = h.wide
+		h.wide.e = w.a + h.pos.y
+		h.pos = Vec { x: h.wide.e, y: w.e }
+		return h.pos.x + h.pos.y + #h.name
+	}
+
+	fn vectors(n: int): int {
+		let mut v = Vec { x: 0, y: 0 }
+		let mut i = 0
+		while (i < n) {
+			v = Vec { x: v.x + i, y: v.y + 1 }
+			i += 1
+		}
+		return v.x * v.y
+	}
+)";
+
+static void declare(Environment& env) {
+	env.native("combine", reinterpret_cast<void*>(combine), "ll)l");
+	env.native("twice", reinterpret_cast<void*>(twice), "l)l");
+	env.native("note", reinterpret_cast<void*>(note), "l)v");
+	env.batch("record", record, "ll)v", 4);
+}
+
+/* how a child exits, a runtime error in the VM exits with 1 */
+enum { REJECTED = 2, CHANGED = 3, RAN = 4, LOADED = 5 };
+
+/* true if 'a' and 'b' have the same opcodes and function types */
+static bool same_shape(const Environment& a, const Environment& b) {
+	if (a.functions.size() != b.functions.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.functions.size(); i++) {
+		auto const& f = a.functions[i];
+		auto const& g = b.functions[i];
+		if (f.type->return_type.index() != g.type->return_type.index() || f.type->args.size() != g.type->args.size()) {
+			return false;
+		}
+		for (size_t k = 0; k < f.type->args.size(); k++) {
+			if (f.type->args[k].index() != g.type->args[k].index()) {
+				return false;
+			}
+		}
+		if (f.code.size() != g.code.size()) {
+			return false;
+		}
+		for (size_t pc = 0; pc < f.code.size(); pc++) {
+			if (f.code[pc].op != g.code[pc].op) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void write(const std::string& path, const std::string& bytes) {
+	std::ofstream(path, std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size());
+}
+
+/* the bytes 'env' saves to 'path' */
+static std::string saved(const Environment& env, const std::string& path) {
+	check(save_bytecode(env, path.c_str()), "could not write '{}'", path);
+	std::ifstream file(path, std::ios::binary);
+	return {std::istreambuf_iterator<char>(file), {}};
+}
+
+/* 'bytes' with a bit flipped, a byte overwritten or its end cut off, as 'round' picks */
+static std::string mutant(std::mt19937& rng, std::string bytes, int round, std::string& what) {
+	switch (round % 3) {
+	case 0: {
+		auto at = rng() % bytes.size();
+		auto bit = rng() % 8;
+		bytes[at] ^= char(1 << bit);
+		what = fmt::format("bit {} of byte {} flipped", bit, at);
+		break;
+	}
+	case 1: {
+		auto at = rng() % bytes.size();
+		bytes[at] = char(rng());
+		what = fmt::format("byte {} set to {}", at, uint8_t(bytes[at]));
+		break;
+	}
+	case 2:
+		bytes.resize(rng() % bytes.size());
+		what = fmt::format("cut to {} bytes", bytes.size());
+		break;
+	}
+	return bytes;
+}
+
+/* 'bytes' with the first 'op' in 'fn' changed by 'change' */
+template <typename Change>
+static std::string patched(std::string bytes, const Function& fn, OPCODE op, Change change) {
+	for (auto I : fn.ir.instructions) {
+		if (I.op == op) {
+			auto at = bytes.find(std::string_view(reinterpret_cast<const char*>(&I), sizeof(I)));
+			check(at != std::string::npos, "'{}' was not saved as compiled", fn.name);
+			change(I);
+			bytes.replace(at, sizeof(I), reinterpret_cast<const char*>(&I), sizeof(I));
+			return bytes;
+		}
+	}
+	check(false, "no opcode {} in '{}'", int(op), fn.name);
+	return bytes;
+}
+
+/* true if 'bytes' load */
+static bool loads(const std::string& path, const std::string& bytes) {
+	write(path, bytes);
+	Environment env{};
+	declare(env);
+	return load_bytecode(env, path.c_str());
+}
+
+/*
+ * Loads 'path' in a child process and runs it if it has the shape of
+ * 'reference', returns the wait status. The child leaves through exit(), as
+ * the VM's runtime errors do, so LeakSanitizer checks every mutant.
+ */
+static int try_mutant(const std::string& path, const Environment& reference) {
+	auto pid = fork();
+	if (pid == 0) {
+		freopen("/dev/null", "w", stdout);
+		Environment env{};
+		declare(env);
+		if (!load_bytecode(env, path.c_str())) {
+			exit(REJECTED);
+		}
+		if (!same_shape(env, reference)) {
+			exit(CHANGED);
+		}
+		itimerval timer{};
+		timer.it_value.tv_usec = 200000;
+		setitimer(ITIMER_REAL, &timer, nullptr);
+		VM vm;
+		for (auto const& fn : env.functions) {
+			if (fn.native == nullptr) {
+				std::vector<Value> args(fn.type->args.size(), Value{.i64 = 3});
+				vm.call(fn, args);
+			}
+		}
+		exit(RAN);
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return status;
+}
+
+/* loads 'path' in a child process without running it, returns the wait status */
+static int try_load(const std::string& path) {
+	auto pid = fork();
+	if (pid == 0) {
+		Environment env{};
+		declare(env);
+		exit(load_bytecode(env, path.c_str()) ? LOADED : REJECTED);
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return status;
+}
+
+/* mutants of 'source' compiled and saved, each must load or be rejected cleanly */
+static void load_mutants(const char* name, const char* source, const std::string& path, std::mt19937& rng) {
+	Environment env{};
+	declare(env);
+	compile(env, source);
+	auto original = saved(env, path);
+	auto status = try_load(path);
+	check(WIFEXITED(status) && WEXITSTATUS(status) == LOADED, "the unmutated {} file does not load", name);
+
+	size_t loaded = 0;
+	for (int i = 0; i < 3000; i++) {
+		std::string what;
+		write(path, mutant(rng, original, i, what));
+		status = try_load(path);
+		auto clean = WIFEXITED(status) && (WEXITSTATUS(status) == REJECTED || WEXITSTATUS(status) == LOADED);
+		if (!clean) {
+			std::filesystem::remove(path);
+		}
+		check(clean, "{} mutant {} ({}) crashed with status {:#x}", name, i, what, status);
+		loaded += WEXITSTATUS(status) == LOADED;
+	}
+	check(loaded >= 100, "only {} {} mutants loaded", loaded, name);
+}
+
+int main() {
+	auto path = (std::filesystem::temp_directory_path() / fmt::format("L_cache_fuzz_{}.lbc", getpid())).string();
+	Environment compiled{};
+	declare(compiled);
+	auto module = compile(compiled, source);
+	auto original = saved(compiled, path);
+	Environment reference{};
+	declare(reference);
+	check(load_bytecode(reference, path.c_str()), "the unmutated file does not load");
+
+	/* host calls read the signature's arguments, B must agree */
+	auto mix = module.function("mix");
+	check(!loads(path, patched(original, *mix, xCALLl, [](auto& I) { I.B = 1; })), "combine() called with 1 argument loaded");
+	check(!loads(path, patched(original, *mix, xCALLl, [](auto& I) { I.B = 3; })), "combine() called with 3 arguments loaded");
+	/* and a batch record is as wide as the signature, xFLUSH only names its callee */
+	check(!loads(path, patched(original, *mix, xBATCH, [](auto& I) { I.B = 3; })), "a record of 3 Values for record() loaded");
+	check(!loads(path, patched(original, *mix, xFLUSH, [](auto& I) { I.A = 1; })), "xFLUSH with A = 1 loaded");
+	check(!loads(path, patched(original, *mix, xFLUSH, [](auto& I) { I.B = 2; })), "xFLUSH with B = 2 loaded");
+	check(loads(path, original), "the unmutated file does not load");
+
+	std::mt19937 rng(1);
+	size_t ran = 0;
+	for (int i = 0; i < 3000; i++) {
+		std::string what;
+		write(path, mutant(rng, original, i, what));
+
+		auto status = try_mutant(path, reference);
+		auto clean = WIFEXITED(status) && WEXITSTATUS(status) != 0 && WEXITSTATUS(status) <= RAN;
+		auto timed_out = WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM;
+		if (!clean && !timed_out) {
+			std::filesystem::remove(path);
+		}
+		check(clean || timed_out, "mutant {} ({}) crashed with status {:#x}", i, what, status);
+		ran += WIFEXITED(status) && WEXITSTATUS(status) == RAN;
+	}
+
+	/* the runs are the point, make sure mutations still get that far */
+	if (ran < 100) {
+		std::filesystem::remove(path);
+	}
+	check(ran >= 100, "only {} mutants loaded and ran", ran);
+
+	load_mutants("strings", strings_source, path, rng);
+	load_mutants("structs", structs_source, path, rng);
+	std::filesystem::remove(path);
+	return 0;
+}
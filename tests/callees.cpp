@@ -0,0 +1,59 @@
+#include "check.hpp"
+#include "cache.hpp"
+
+#include <filesystem>
+#include <unistd.h>
+
+/*
+ * A CALL names its callee by position in the caller's callee table, in C.
+ * Past 256 callees C needs a WIDE word, which compiling, linking, saving
+ * and loading must all carry through, the last call being a TAILCALL.
+ */
+
+static int64_t offset(int64_t x) {
+	return x + 1000000;
+}
+
+constexpr int functions = 1000;
+
+/* f0 ... f999 and one function calling them all, then a native, then the last in tail position */
+static std::string generate() {
+	std::string src;
+	for (int i = 0; i < functions; i++) {
+		src += fmt::format("fn f{0}(x: int): int {{\n\treturn x + {0}\n}}\n", i);
+	}
+	src += "fn caller(x: int): int {\n\tlet mut s = 0\n";
+	for (int i = 0; i < functions - 1; i++) {
+		src += fmt::format("\ts += f{}(x)\n", i);
+	}
+	src += fmt::format("\ts = offset(s)\n\treturn f{}(s)\n}}\n", functions - 1);
+	return src;
+}
+
+int main() {
+	auto src = generate();
+	int64_t x = 5;
+	int64_t expected = (functions - 1) * x + int64_t(functions - 1) * (functions - 2) / 2 + 1000000 + (functions - 1);
+
+	Environment env{};
+	env.native("offset", reinterpret_cast<void*>(offset), "l)l");
+	auto module = compile(env, src);
+	auto caller = module.function("caller");
+	check(caller->ir.callees.size() == functions + 1, "caller has {} callees", caller->ir.callees.size());
+	auto last = decode(caller->ir.instructions, caller->ir.instructions.size() - 1);
+	check(last.op == TAILCALL && last.C == functions, "caller does not end in a TAILCALL to f{}", functions - 1);
+	VM vm;
+	auto result = run(vm, module, "caller", {x}).i64;
+	check(result == expected, "caller({}) = {}, expected {}", x, result, expected);
+
+	auto path = (std::filesystem::temp_directory_path() / fmt::format("L_callees_{}.lbc", getpid())).string();
+	check(save_bytecode(env, path.c_str()), "could not write '{}'", path);
+	Environment loaded{};
+	loaded.native("offset", reinterpret_cast<void*>(offset), "l)l");
+	auto ok = load_bytecode(loaded, path.c_str());
+	std::filesystem::remove(path);
+	check(ok, "the saved file does not load");
+	result = vm.call(*loaded.find("caller"), {{Value{.i64 = x}}}).i64;
+	check(result == expected, "loaded caller({}) = {}, expected {}", x, result, expected);
+	return 0;
+}
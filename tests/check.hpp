@@ -0,0 +1,69 @@
+#pragma once
+
+#include "vm.hpp"
+#include "parser.h"
+
+#include <fmt/format.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* compile() hands every function it finishes to dump(), main.cpp prints them; each test is one file */
+void dump(FuncState&) {}
+
+/* fails the test with a message when 'condition' does not hold */
+#define check(condition, ...) \
+	if (!(condition)) { \
+		fmt::print("{}:{}: check failed: {}\n", __FILE__, __LINE__, #condition); \
+		fmt::print(__VA_ARGS__); \
+		fmt::print("\n"); \
+		exit(1); \
+	}
+
+/* runs 'name' from 'module' with integer arguments */
+inline Value run(VM& vm, const Module& module, std::string_view name, std::initializer_list<int64_t> args = {}) {
+	auto fn = module.function(name);
+	check(fn != nullptr, "no function '{}'", name);
+	std::vector<Value> values;
+	for (auto arg : args) {
+		values.push_back({.i64 = arg});
+	}
+	return vm.call(*fn, values);
+}
+
+/* what a child process printed, and how it ended */
+struct Outcome {
+	std::string text;
+	int status = 0;
+
+	bool aborted() const {
+		return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+	}
+	bool exited(int code) const {
+		return WIFEXITED(status) && WEXITSTATUS(status) == code;
+	}
+};
+
+/* runs 'body' in a child process with its stdout unbuffered into a pipe, for errors that end the process */
+template <typename Body>
+Outcome in_child(Body body) {
+	int out[2];
+	check(pipe(out) == 0, "pipe failed");
+	auto pid = fork();
+	if (pid == 0) {
+		close(out[0]);
+		dup2(out[1], STDOUT_FILENO);
+		setvbuf(stdout, nullptr, _IONBF, 0);
+		body();
+		_exit(0);
+	}
+	close(out[1]);
+	Outcome outcome;
+	char buffer[256];
+	for (ssize_t n; (n = read(out[0], buffer, sizeof(buffer))) > 0;) {
+		outcome.text.append(buffer, n);
+	}
+	close(out[0]);
+	waitpid(pid, &outcome.status, 0);
+	return outcome;
+}
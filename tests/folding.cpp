@@ -0,0 +1,100 @@
+#include "check.hpp"
+
+#include <csignal>
+
+/*
+ * Integer expressions of constants are evaluated by the compiler, and must
+ * give what the VM gives for the same operands: +, -, * wrap, / and %
+ * truncate toward zero. Division by zero and INT64_MIN / -1 are not folded,
+ * they trap at run time as they would with variables.
+ *
+ * Each case is compiled twice, once on literals and once on arguments, and
+ * the two have to agree.
+ */
+
+static const struct {
+	const char* lhs;
+	int64_t lhs_value;
+	char op;
+	const char* rhs;
+	int64_t rhs_value;
+	bool folds;
+} cases[] = {
+	{"7", 7, '/', "2", 2, true},
+	{"-7", -7, '/', "2", 2, true},
+	{"7", 7, '/', "-2", -2, true},
+	{"-7", -7, '/', "-2", -2, true},
+	{"7", 7, '%', "2", 2, true},
+	{"-7", -7, '%', "2", 2, true},
+	{"7", 7, '%', "-2", -2, true},
+	{"-7", -7, '%', "-2", -2, true},
+	{"9223372036854775807", INT64_MAX, '+', "1", 1, true},
+	{"(-9223372036854775807 - 1)", INT64_MIN, '-', "1", 1, true},
+	{"4611686018427387904", int64_t(1) << 62, '*', "4", 4, true},
+	{"(-9223372036854775807 - 1)", INT64_MIN, '%', "-1", -1, false},
+	{"(-9223372036854775807 - 1)", INT64_MIN, '/', "-1", -1, false},
+	{"5", 5, '/', "0", 0, false},
+	{"5", 5, '%', "0", 0, false},
+	{"0", 0, '%', "(3 - 3)", 0, false},
+};
+
+/* what the VM computes, for the cases that do not trap */
+static int64_t expected(int64_t lhs, char op, int64_t rhs) {
+	switch (op) {
+	case '+': return int64_t(uint64_t(lhs) + uint64_t(rhs));
+	case '-': return int64_t(uint64_t(lhs) - uint64_t(rhs));
+	case '*': return int64_t(uint64_t(lhs) * uint64_t(rhs));
+	case '/': return lhs / rhs;
+	default: return lhs % rhs;
+	}
+}
+
+/* true if 'fn' does integer arithmetic at run time */
+static bool computes(const Function& fn) {
+	for (auto const& I : fn.code) {
+		if ((I.op >= IADD && I.op <= INEG) || (I.op >= IADDK && I.op <= IMODK)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int main() {
+	std::string src;
+	for (size_t i = 0; i < std::size(cases); i++) {
+		auto const& c = cases[i];
+		src += fmt::format("fn folded{}(): int {{\n\treturn {} {} {}\n}}\n", i, c.lhs, c.op, c.rhs);
+		src += fmt::format("fn unfolded{}(x: int, y: int): int {{\n\treturn x {} y\n}}\n", i, c.op);
+	}
+	Environment env{};
+	auto module = compile(env, src);
+	VM vm;
+
+	for (size_t i = 0; i < std::size(cases); i++) {
+		auto const& c = cases[i];
+		auto folded = module.function(fmt::format("folded{}", i));
+		auto unfolded = module.function(fmt::format("unfolded{}", i));
+		auto text = fmt::format("{} {} {}", c.lhs, c.op, c.rhs);
+		check(computes(*folded) != c.folds, "'{}' {}", text, c.folds ? "was not folded" : "was folded");
+
+		Value args[] = {{.i64 = c.lhs_value}, {.i64 = c.rhs_value}};
+		if (c.folds) {
+			auto value = vm.call(*folded).i64;
+			auto variable = vm.call(*unfolded, args).i64;
+			auto want = expected(c.lhs_value, c.op, c.rhs_value);
+			check(value == want && variable == want, "'{}' = {} folded, {} at run time, expected {}", text, value, variable, want);
+			continue;
+		}
+		auto with_constants = in_child([&] {
+			VM vm;
+			vm.call(*folded);
+		});
+		auto with_variables = in_child([&] {
+			VM vm;
+			vm.call(*unfolded, args);
+		});
+		check(WIFSIGNALED(with_constants.status) && WTERMSIG(with_constants.status) == SIGFPE, "'{}' did not trap, status {:#x}", text, with_constants.status);
+		check(with_constants.status == with_variables.status, "'{}' ended with {:#x}, on variables {:#x}", text, with_constants.status, with_variables.status);
+	}
+	return 0;
+}
@@ -0,0 +1,205 @@
+#include "../src/lex.cpp"
+#include "check.hpp"
+
+#include <random>
+
+/*
+ * The lexer's character class scanners against their scalar definition.
+ * The scanner is compiled into this file, so CMake builds it once per mode:
+ * test_lexer with the compiler's default target (SSE2 on x86-64),
+ * test_lexer_scalar with L_SIMD=0 and test_lexer_avx2 with -mavx2.
+ *
+ * Every scan() is compared with a byte at a time loop over Class::test(char),
+ * for every byte value at every offset within and across a vector, and for
+ * runs cut short by the end of the source. Generated sources are then lexed
+ * and their tokens compared with what was generated.
+ */
+
+/* what scan() has to return, one byte at a time */
+template <typename Class>
+static size_t scan_bytes(std::string_view src, size_t i) {
+	while (i < src.size() && Class::test(src[i])) {
+		i++;
+	}
+	return i;
+}
+
+/* the bytes inside 'Class' */
+template <typename Class>
+static std::string members() {
+	std::string inside;
+	for (int c = 0; c < 256; c++) {
+		if (Class::test(char(c))) {
+			inside += char(c);
+		}
+	}
+	return inside;
+}
+
+template <typename Class>
+static void same_scan(const char* name, std::string_view src, size_t i) {
+	auto got = scan<Class>(src, i);
+	auto want = scan_bytes<Class>(src, i);
+	check(got == want, "{} scan from {} over {} bytes stopped at {}, expected {}", name, i, src.size(), got, want);
+}
+
+/*
+ * A run of 'length' members at 'offset', ended by each byte value in turn,
+ * with members behind the stop so a scanner that misses it runs on. The run
+ * is also scanned without its stop, ending at the end of the source.
+ */
+template <typename Class>
+static void scan_stops(const char* name, std::mt19937& rng) {
+	constexpr size_t width = 64;
+	auto inside = members<Class>();
+	std::string src;
+	for (size_t offset = 0; offset < width; offset++) {
+		for (size_t length = 0; length <= width + 1; length++) {
+			src.assign(offset, '\0');
+			for (size_t i = 0; i < length + 1 + width; i++) {
+				src += inside[rng() % inside.size()];
+			}
+			for (int stop = 0; stop < 256; stop++) {
+				src[offset + length] = char(stop);
+				same_scan<Class>(name, src, offset);
+			}
+			same_scan<Class>(name, std::string_view(src).substr(0, offset + length), offset);
+		}
+	}
+}
+
+/* mostly members with a few other bytes, scanned from every index */
+template <typename Class>
+static void scan_random(const char* name, std::mt19937& rng) {
+	auto inside = members<Class>();
+	for (int round = 0; round < 2000; round++) {
+		std::string src(rng() % 100, '\0');
+		for (auto& c : src) {
+			c = rng() % 16 == 0 ? char(rng()) : inside[rng() % inside.size()];
+		}
+		for (size_t i = 0; i <= src.size(); i++) {
+			same_scan<Class>(name, src, i);
+		}
+	}
+}
+
+template <typename Class>
+static void scans(const char* name, std::mt19937& rng) {
+	scan_stops<Class>(name, rng);
+	scan_random<Class>(name, rng);
+}
+
+struct Expected {
+	token_type type;
+	std::string text;
+};
+
+static std::string pick(std::mt19937& rng, std::string_view from, size_t length) {
+	std::string s;
+	for (size_t i = 0; i < length; i++) {
+		s += from[rng() % from.size()];
+	}
+	return s;
+}
+
+/* appends one token to 'src', with what the lexer must make of it */
+static Expected generate(std::mt19937& rng, std::string& src) {
+	static const std::string letters = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	static const std::string digits = "0123456789";
+	static const struct {
+		const char* text;
+		token_type type;
+	} punctuation[] = {
+		{"(", left_paren}, {")", right_paren}, {"{", left_curve}, {"}", right_curve},
+		{"[", left_brace}, {"]", right_brace}, {";", semicolon}, {":", colon},
+		{",", comma}, {"#", LEN}, {"..", concat}, {"==", eq}, {"<=", le}, {"+=", plus_assign},
+	};
+
+	switch (rng() % 5) {
+	case 0: {
+		auto text = pick(rng, letters, 1) + pick(rng, letters + digits + "_", rng() % 70);
+		src += text;
+		return {find_keyword(text), text};
+	}
+	case 1: {
+		auto text = pick(rng, digits, 1 + rng() % 18);
+		src += text;
+		return {integer_literal, text};
+	}
+	case 2: {
+		auto text = pick(rng, digits, 1 + rng() % 20) + "." + pick(rng, digits, 1 + rng() % 40);
+		src += text;
+		return {float_literal, text};
+	}
+	case 3: {
+		/* any byte a literal may hold as it is, bytes >= 0x80 included, and escapes */
+		static const auto plain = members<StringClass>();
+		std::string text;
+		src += '"';
+		for (size_t i = rng() % 80; i > 0; i--) {
+			if (rng() % 8 == 0) {
+				static const char escapes[][2] = {{'n', '\n'}, {'r', '\r'}, {'t', '\t'}, {'v', '\v'}};
+				auto const& escape = escapes[rng() % 4];
+				src += '\\';
+				src += escape[0];
+				text += escape[1];
+			} else {
+				auto c = plain[rng() % plain.size()];
+				src += c;
+				text += c;
+			}
+		}
+		src += '"';
+		return {string_literal, text};
+	}
+	default: {
+		auto const& p = punctuation[rng() % std::size(punctuation)];
+		src += p.text;
+		return {p.type, ""};
+	}
+	}
+}
+
+static void lex_sources(std::mt19937& rng) {
+	for (int round = 0; round < 2000; round++) {
+		std::string src;
+		std::vector<Expected> expected;
+		for (size_t n = rng() % 40; n > 0; n--) {
+			src += pick(rng, " \t\n\r\x0C", 1 + rng() % 40);
+			expected.push_back(generate(rng, src));
+		}
+		if (rng() % 2 == 0) {
+			src += pick(rng, " \t\n\r\x0C", rng() % 40);
+		}
+
+		LexState ls{src};
+		for (size_t i = 0; i <= expected.size(); i++) {
+			ls.next();
+			if (i == expected.size()) {
+				check(ls.token.type == end_of_source, "source {}: '{}' after the last token", round, Token::to_string(ls.token.type));
+				break;
+			}
+			auto const& want = expected[i];
+			check(ls.token.type == want.type, "source {}, token {}: '{}', expected '{}'", round, i, Token::to_string(ls.token.type), Token::to_string(want.type));
+			if (!want.text.empty() || want.type == string_literal) {
+				check(ls.token.string == want.text, "source {}, token {}: '{}', expected '{}'", round, i, ls.token.string, want.text);
+			}
+		}
+	}
+}
+
+int main() {
+#if defined(__AVX2__)
+	if (!__builtin_cpu_supports("avx2")) {
+		fmt::print("no AVX2 on this machine\n");
+		return 77;
+	}
+#endif
+	std::mt19937 rng(1);
+	scans<SpaceClass>("space", rng);
+	scans<DigitClass>("digit", rng);
+	scans<IdentClass>("identifier", rng);
+	scans<StringClass>("string", rng);
+	lex_sources(rng);
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include "check.hpp"
+
+/*
+ * Host functions of up to four int, int64_t, double and pointer arguments
+ * are called through a trampoline compiled into the interpreter, without
+ * dyncall. An int takes its value's low 32 bits, as a C cast would.
+ */
+
+static int last = 0;
+
+static void note(int x) {
+	last = x;
+}
+
+static int add(int a, int b) {
+	return a + b;
+}
+
+static int64_t scale(int a, int64_t b) {
+	return int64_t(a) * b;
+}
+
+static double mix(double a, int b, int64_t c, double d) {
+	return a * b + double(c) - d;
+}
+
+static const char* source = R"(
+	fn run_note(x: int): int {
+		note(x)
+		return 0
+	}
+
+	fn run_add(x: int): int {
+		return add(x, 4294967296 + 7)
+	}
+
+	fn run_scale(x: int): int {
+		return scale(x, 3000000000)
+	}
+
+	fn run_mix(x: int): float {
+		return mix(1.5, x, 10, 0.25)
+	}
+)";
+
+int main() {
+	Environment env{};
+	env.native("note", reinterpret_cast<void*>(note), "i)v");
+	env.native("add", reinterpret_cast<void*>(add), "ii)i");
+	env.native("scale", reinterpret_cast<void*>(scale), "il)l");
+	env.native("mix", reinterpret_cast<void*>(mix), "dild)d");
+	for (auto name : {"note", "add", "scale", "mix"}) {
+		check(env.find(name)->signature->trampoline != nullptr, "'{}' has no trampoline", name);
+	}
+	/* the rest go through dyncall */
+	check(env.signature("s)v")->trampoline == nullptr, "'s)v' has a trampoline");
+	check(env.signature("iiiii)i")->trampoline == nullptr, "'iiiii)i' has a trampoline");
+
+	auto module = compile(env, source);
+	VM vm;
+	run(vm, module, "run_note", {-3});
+	check(last == -3, "note(-3) saw {}", last);
+	run(vm, module, "run_note", {(int64_t(1) << 32) + 5});
+	check(last == 5, "note(2^32 + 5) saw {}", last);
+
+	auto result = run(vm, module, "run_add", {-10});
+	check(result.i64 == -3, "add(-10, 2^32 + 7) = {}", result.i64);
+	result = run(vm, module, "run_scale", {-2});
+	check(result.i64 == -6000000000, "scale(-2, 3000000000) = {}", result.i64);
+	result = run(vm, module, "run_mix", {4});
+	check(result.f64 == 15.75, "mix(1.5, 4, 10, 0.25) = {}", result.f64);
+	return 0;
+}
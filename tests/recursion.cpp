@@ -0,0 +1,69 @@
+#include "check.hpp"
+
+/*
+ * Tail calls run in constant stack, other recursion grows the stack up to
+ * VM::MAX_STACK. With the argument "overflow", recurses past it, which must
+ * stop with "stack overflow".
+ */
+
+static const char* source = R"(
+	fn count(n: int, acc: int): int {
+		if (n == 0) {
+			return acc
+		}
+		return count(n - 1, acc + 1)
+	}
+
+	fn even(n: int): int {
+		if (n == 0) {
+			return 1
+		}
+		return odd(n - 1)
+	}
+
+	fn odd(n: int): int {
+		if (n == 0) {
+			return 0
+		}
+		return even(n - 1)
+	}
+
+	fn deep(n: int): int {
+		if (n == 0) {
+			return 0
+		}
+		return deep(n - 1) + 1
+	}
+)";
+
+int main(int argc, char** argv) {
+	Environment env{};
+	auto module = compile(env, source);
+
+	if (argc > 1 && std::string_view(argv[1]) == "overflow") {
+		VM vm;
+		run(vm, module, "deep", {int64_t(VM::MAX_STACK)});
+		fmt::print("deep({}) returned\n", VM::MAX_STACK);
+		return 0;
+	}
+
+	VM vm;
+	auto result = run(vm, module, "count", {1000000, 0});
+	check(result.i64 == 1000000, "count(1000000, 0) = {}", result.i64);
+	check(vm.high_water <= VM::MIN_STACK, "tail recursion used {} stack slots", vm.high_water);
+
+	result = run(vm, module, "even", {1000001});
+	check(result.i64 == 0, "even(1000001) = {}", result.i64);
+	result = run(vm, module, "odd", {1000001});
+	check(result.i64 == 1, "odd(1000001) = {}", result.i64);
+	check(vm.high_water <= VM::MIN_STACK, "mutual tail recursion used {} stack slots", vm.high_water);
+	check(vm.frames.empty(), "{} frames left behind", vm.frames.size());
+
+	/* one slot a level, as deep as the stack allows */
+	auto levels = int64_t(VM::MAX_STACK) - module.function("deep")->stack_size;
+	result = run(vm, module, "deep", {levels});
+	check(result.i64 == levels, "deep({}) = {}", levels, result.i64);
+	check(vm.high_water == VM::MAX_STACK, "deep({}) used {} stack slots", levels, vm.high_water);
+	check(vm.frames.empty(), "{} frames left behind", vm.frames.size());
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include "check.hpp"
+
+/*
+ * VM::call resets the VM heap after every call, so a result that lives in
+ * it, a long string or a struct block or either inside a struct, is copied
+ * across the reset and must read back whole. Results that live entirely
+ * in registers are returned as they are.
+ */
+
+static const char* source = R"(
+	struct Big { a: int, b: int, c: int, d: int, e: int }
+	struct Named { id: int, name: string }
+	struct Labelled { label: string, big: Big, other: string }
+
+	fn text(x: int): string {
+		if (x > 0) {
+			return "a string too long to be " .. "inline"
+		}
+		return "short"
+	}
+
+	fn big(x: int): Big {
+		return Big { a: x, b: 2, c: 3, d: 4, e: 5 }
+	}
+
+	fn named(x: int): Named {
+		if (x > 0) {
+			return Named { id: x, name: "a name" .. " long enough for a body" }
+		}
+		return Named { id: x, name: "ab" }
+	}
+
+	fn labelled(x: int): Labelled {
+		return Labelled { label: "the label, built " .. "on the heap", big: big(x), other: text(x) }
+	}
+)";
+
+int main() {
+	Environment env{};
+	auto module = compile(env, source);
+	VM vm;
+
+	auto result = run(vm, module, "text", {1});
+	check(string_view(result.u64) == "a string too long to be inline", "text(1) = '{}'", string_view(result.u64));
+	result = run(vm, module, "text", {0});
+	check(string_view(result.u64) == "short", "text(0) = '{}'", string_view(result.u64));
+
+	result = run(vm, module, "big", {7});
+	auto slots = static_cast<const Value*>(result.p);
+	check(slots[0].i64 == 7 && slots[4].i64 == 5, "big(7) = {{ {}, ..., {} }}", slots[0].i64, slots[4].i64);
+
+	/* a struct in registers comes back in the VM's first registers */
+	run(vm, module, "named", {3});
+	check(vm.stack[0].i64 == 3, "named(3).id = {}", vm.stack[0].i64);
+	check(string_view(vm.stack[1].u64) == "a name long enough for a body", "named(3).name = '{}'", string_view(vm.stack[1].u64));
+	run(vm, module, "named", {0});
+	check(vm.stack[0].i64 == 0 && string_view(vm.stack[1].u64) == "ab", "named(0) = {{ {}, '{}' }}", vm.stack[0].i64, string_view(vm.stack[1].u64));
+
+	result = run(vm, module, "labelled", {9});
+	slots = static_cast<const Value*>(result.p);
+	check(string_view(slots[0].u64) == "the label, built on the heap", "labelled(9).label = '{}'", string_view(slots[0].u64));
+	check(slots[1].i64 == 9 && slots[5].i64 == 5, "labelled(9).big = {{ {}, ..., {} }}", slots[1].i64, slots[5].i64);
+	check(string_view(slots[6].u64) == "a string too long to be inline", "labelled(9).other = '{}'", string_view(slots[6].u64));
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include "check.hpp"
+
+/*
+ * Calls are checked against the callee's signature wherever it is defined,
+ * and results against the caller's. Scripts that break a rule must not
+ * compile, each is compiled in a child process, which has to abort with
+ * the expected message.
+ */
+
+static const char* source = R"(
+	fn half(x: int): float {
+		return twice(x) / 4.0
+	}
+
+	fn twice(x: int): float {
+		if (x > 0) {
+			return 2.0 * x_float(x)
+		} else {
+			return 0.0
+		}
+	}
+
+	fn x_float(x: int): float {
+		let mut f = 0.0
+		let mut i = 0
+		while (i < x) {
+			f += 1.0
+			i += 1
+		}
+		return f
+	}
+
+	fn forever(x: int): int {
+		let mut i = x
+		while (true) {
+			i += 1
+			if (i > 10) {
+				return i
+			}
+		}
+	}
+
+	fn log(x: int) {
+		if (x > 0) {
+			return
+		}
+	}
+)";
+
+static const struct {
+	const char* source;
+	const char* message;
+} errors[] = {
+	{"fn s(): string { return 6 }", "'s' returns a value of the wrong type"},
+	{"fn t(): int { return \"some long literal\" }", "'t' returns a value of the wrong type"},
+	{"fn b(): bool { return 1 }", "'b' returns a value of the wrong type"},
+	{"fn v(x: int) { return x }", "'v' returns a value of the wrong type"},
+	{"fn r(x: int): int { return }", "'r' must return a value"},
+	{"fn u(): string { }", "'u' can reach its end without returning a value"},
+	{"fn p(x: int): int { if (x > 1) { return 1 } }", "'p' can reach its end without returning a value"},
+	{"fn a(x: int): int { return b(x, 7) } fn b(x: int): int { return x }", "'b' expects 1 arguments, got more"},
+	{"fn a(x: int): int { return b() } fn b(x: int): int { return x }", "'b' expects 1 arguments, got 0"},
+	{"fn a(x: int): int { return b(x) } fn b(x: float): int { return 1 }", "argument 1 of 'b' has the wrong type"},
+	{"fn a(x: int): int { return b(x) }", "'b' is not defined"},
+	{"fn a(): int { return 1 } fn a(): int { return 2 }", "redefinition of 'a'"},
+};
+
+int main() {
+	Environment env{};
+	auto module = compile(env, source);
+	VM vm;
+
+	auto result = run(vm, module, "half", {3});
+	check(result.f64 == 1.5, "half(3) = {}", result.f64);
+	result = run(vm, module, "half", {0});
+	check(result.f64 == 0.0, "half(0) = {}", result.f64);
+	result = run(vm, module, "forever", {2});
+	check(result.i64 == 11, "forever(2) = {}", result.i64);
+	run(vm, module, "log", {1});
+
+	for (auto const& error : errors) {
+		auto child = in_child([&] {
+			Environment env{};
+			compile(env, error.source);
+		});
+		check(child.aborted() && child.text == std::string(error.message) + "\n", "'{}' gave '{}', expected '{}'", error.source, child.text, error.message);
+	}
+	return 0;
+}
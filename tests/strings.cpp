@@ -0,0 +1,126 @@
+#include "check.hpp"
+
+/*
+ * Strings as scripts see them: '..', '#', == and the orderings, on strings
+ * the host passes in so nothing is folded. Strings of up to
+ * MAX_INLINE_STRING bytes are held inline and longer ones in a body, a
+ * result has to be the same string whichever way it was built, and equal
+ * literals share one body.
+ */
+
+static const char* source = R"(
+	fn cat(a: string, b: string): string {
+		return a .. b
+	}
+
+	fn length(a: string): int {
+		return #a
+	}
+
+	fn equal(a: string, b: string): int {
+		if (a == b) {
+			return 1
+		}
+		return 0
+	}
+
+	fn unequal(a: string, b: string): int {
+		if (a != b) {
+			return 1
+		}
+		return 0
+	}
+
+	fn order(a: string, b: string): int {
+		let mut result = 0
+		if (a < b) {
+			result = result + 1
+		}
+		if (a <= b) {
+			result = result + 10
+		}
+		if (a > b) {
+			result = result + 100
+		}
+		if (a >= b) {
+			result = result + 1000
+		}
+		return result
+	}
+
+	fn literal(): string {
+		return "a literal long enough for a body"
+	}
+
+	fn same_literal(): string {
+		return "a literal long " .. "enough for a body"
+	}
+
+	fn is_literal(s: string): int {
+		if (s == "a literal long enough for a body") {
+			return 1
+		}
+		return 0
+	}
+)";
+
+/* what order() returns for 'a' against 'b' */
+static int64_t expected_order(std::string_view a, std::string_view b) {
+	return (a < b ? 1 : 0) + (a <= b ? 10 : 0) + (a > b ? 100 : 0) + (a >= b ? 1000 : 0);
+}
+
+int main() {
+	Environment env{};
+	auto module = compile(env, source);
+	VM vm;
+	Arena arena;
+	auto call = [&](std::string_view name, std::initializer_list<std::string_view> texts) {
+		std::vector<Value> args;
+		for (auto text : texts) {
+			args.push_back({.u64 = make_string(arena, text)});
+		}
+		return vm.call(*module.function(name), args);
+	};
+
+	/* every split of every string up to twice the inline size */
+	std::string all = "abcdefghijklmnop";
+	for (size_t size = 0; size <= all.size(); size++) {
+		auto whole = std::string_view(all).substr(0, size);
+		for (size_t split = 0; split <= size; split++) {
+			auto lhs = whole.substr(0, split);
+			auto rhs = whole.substr(split);
+			auto result = call("cat", {lhs, rhs}).u64;
+			check(string_view(result) == whole, "'{}' .. '{}' = '{}'", lhs, rhs, string_view(result));
+			check(is_inline_string(result) == (size <= MAX_INLINE_STRING), "'{}' .. '{}' is {}inline", lhs, rhs, is_inline_string(result) ? "" : "not ");
+			check(string_equal(result, make_string(arena, whole)), "'{}' .. '{}' differs from '{}'", lhs, rhs, whole);
+		}
+		auto length = call("length", {whole}).i64;
+		check(length == int64_t(size), "#'{}' = {}", whole, length);
+	}
+
+	const char* texts[] = {
+		"", "a", "b", "ab", "abc", "abcdefg", "abcdefh", "abcdefgh", "abcdefgi",
+		"a string long enough for a body", "a string long enough for a bodz",
+		"a string long enough for a body, and more", "\x80", "a\xff", "a\x01",
+	};
+	for (auto a : texts) {
+		for (auto b : texts) {
+			auto same = std::string_view(a) == std::string_view(b);
+			auto equal = call("equal", {a, b}).i64;
+			auto unequal = call("unequal", {a, b}).i64;
+			check(equal == same && unequal == !same, "'{}' == '{}' is {}, != is {}", a, b, equal, unequal);
+			auto order = call("order", {a, b}).i64;
+			check(order == expected_order(a, b), "'{}' against '{}' ordered as {}, expected {}", a, b, order, expected_order(a, b));
+		}
+	}
+
+	/* literals are interned, so equal ones are the same body, folded or not */
+	auto literal = vm.call(*module.function("literal")).u64;
+	auto same_literal = vm.call(*module.function("same_literal")).u64;
+	check(!is_inline_string(literal) && string_body(literal) == string_body(same_literal), "equal literals have different bodies");
+	auto built = call("is_literal", {"a literal long enough for a body"}).i64;
+	check(built == 1, "a string built by the host differs from the equal literal");
+	auto other = call("is_literal", {"a literal long enough for a bodY"}).i64;
+	check(other == 0, "a different string equals the literal");
+	return 0;
+}
@@ -0,0 +1,180 @@
+#include "check.hpp"
+
+/*
+ * Structs are values: assigning one, passing it or storing it in a field
+ * copies it, so changing the copy never shows through the original and
+ * the other way round. This has to hold for structs kept in registers
+ * (Vec, Rect) and for those kept in a heap block (Wide, Holder), and for a
+ * block nested in another block, which is reached through FIELDPTR and
+ * copied with SCOPY.
+ */
+
+static const char* source = R"(
+	struct Vec { x: int, y: int }
+	struct Rect { lo: Vec, hi: Vec }
+	struct Wide { a: int, b: int, c: int, d: int, e: int }
+	struct Holder { tag: int, pos: Vec, wide: Wide, name: string }
+
+	fn wide(a: int): Wide {
+		return Wide { a: a, b: a + 1, c: a + 2, d: a + 3, e: a + 4 }
+	}
+
+	fn holder(a: int): Holder {
+		return Holder { tag: a, pos: Vec { x: a, y: -a }, wide: wide(a), name: "a name long enough for a body" }
+	}
+
+	fn bump(v: Vec): int {
+		let mut w = v
+		w.x += 1
+		return w.x
+	}
+
+	fn clear(w: Wide): int {
+		let mut c = w
+		c.a = 0
+		c.e = 0
+		return c.a + c.e
+	}
+
+	fn register_copy(x: int): int {
+		let mut a = Vec { x: x, y: 2 }
+		let b = a
+		a.x = 100
+		return b.x * 1000 + a.x
+	}
+
+	fn register_copy_back(x: int): int {
+		let a = Vec { x: x, y: 2 }
+		let mut b = a
+		b.y = 100
+		return a.y * 1000 + b.y
+	}
+
+	fn register_argument(x: int): int {
+		let v = Vec { x: x, y: 0 }
+		let bumped = bump(v)
+		return v.x * 1000 + bumped
+	}
+
+	fn nested_register(x: int): int {
+		let mut r = Rect { lo: Vec { x: x, y: 0 }, hi: Vec { x: 9, y: 9 } }
+		let lo = r.lo
+		r.lo.x = 50
+		return lo.x * 1000 + r.lo.x
+	}
+
+	fn block_copy(x: int): int {
+		let mut a = wide(x)
+		let b = a
+		a.a = 100
+		a.e = 200
+		return b.a * 1000 + b.e
+	}
+
+	fn block_copy_back(x: int): int {
+		let a = wide(x)
+		let mut b = a
+		b.c = 100
+		return a.c * 1000 + b.c
+	}
+
+	fn block_argument(x: int): int {
+		let w = wide(x)
+		let cleared = clear(w)
+		return w.a * 1000 + w.e * 10 + cleared
+	}
+
+	fn block_results(x: int): int {
+		let mut p = wide(x)
+		let q = wide(x)
+		p.a = 50
+		return q.a * 1000 + p.a
+	}
+
+	fn nested_block_read(x: int): int {
+		let mut h = holder(x)
+		let w = h.wide
+		h.wide.a = 77
+		h.wide.e = 88
+		return w.a * 1000 + w.e * 10 + h.wide.a - 77
+	}
+
+	fn nested_block_write(x: int): int {
+		let mut h = holder(1)
+		let mut w = wide(x)
+		h.wide = w
+		w.b = 500
+		return h.wide.b * 1000 + w.b
+	}
+
+	fn nested_register_field(x: int): int {
+		let mut v = Vec { x: x, y: 0 }
+		let mut h = holder(1)
+		h.pos = v
+		v.x = 300
+		h.pos.y = 7
+		return h.pos.x * 1000 + v.y * 10 + h.pos.y
+	}
+
+	fn block_assign(x: int): int {
+		let mut a = holder(1)
+		let b = holder(x)
+		a = b
+		a.tag = 60
+		a.wide.d = 70
+		return b.tag * 10000 + b.wide.d * 100 + a.tag
+	}
+
+	fn string_field(x: int): int {
+		let mut h = holder(x)
+		let g = h
+		h.name = h.name .. ", now longer"
+		return #g.name * 1000 + #h.name
+	}
+
+	fn looped(x: int): int {
+		let mut w = wide(0)
+		let mut kept = wide(0)
+		let mut i = 0
+		while (i < x) {
+			w.a += i
+			if (i == 3) {
+				kept = w
+			}
+			i += 1
+		}
+		return kept.a * 1000 + w.a
+	}
+)";
+
+int main() {
+	Environment env{};
+	auto module = compile(env, source);
+	VM vm;
+
+	const int64_t x = 6;
+	const struct {
+		const char* name;
+		int64_t expected;
+	} cases[] = {
+		{"register_copy", x * 1000 + 100},
+		{"register_copy_back", 2 * 1000 + 100},
+		{"register_argument", x * 1000 + x + 1},
+		{"nested_register", x * 1000 + 50},
+		{"block_copy", x * 1000 + x + 4},
+		{"block_copy_back", (x + 2) * 1000 + 100},
+		{"block_argument", x * 1000 + (x + 4) * 10},
+		{"block_results", x * 1000 + 50},
+		{"nested_block_read", x * 1000 + (x + 4) * 10},
+		{"nested_block_write", (x + 1) * 1000 + 500},
+		{"nested_register_field", x * 1000 + 7},
+		{"block_assign", x * 10000 + (x + 3) * 100 + 60},
+		{"string_field", 29 * 1000 + 41},
+		{"looped", 6 * 1000 + 15},
+	};
+	for (auto const& c : cases) {
+		auto result = run(vm, module, c.name, {x}).i64;
+		check(result == c.expected, "{}({}) = {}, expected {}", c.name, x, result, c.expected);
+	}
+	return 0;
+}
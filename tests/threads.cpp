@@ -0,0 +1,117 @@
+#include "check.hpp"
+
+#include <atomic>
+#include <thread>
+
+/*
+ * One Environment, compiled once, run by a VM per thread at the same time.
+ * Every thread must get the results a single VM gets, host functions see
+ * every call, and nothing is written to the shared code.
+ */
+
+static std::atomic<int64_t> total{0};
+
+static int64_t add_total(int64_t value) {
+	return total += value;
+}
+
+static std::atomic<int64_t> batched{0};
+
+static void add_batch(const Value* records, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		batched += records[i].i64;
+	}
+}
+
+static const char* source = R"(
+	struct Pair { a: int, b: int }
+
+	fn fib(n: int): int {
+		if (n < 2) {
+			return n
+		}
+		return fib(n - 1) + fib(n - 2)
+	}
+
+	fn label(n: int): int {
+		let mut s = "thread"
+		let mut i = 0
+		while (i < n) {
+			s = s .. "-" .. "a longer piece of text"
+			i += 1
+		}
+		return #s
+	}
+
+	fn swap(p: Pair): Pair {
+		return Pair { a: p.b, b: p.a }
+	}
+
+	fn pairs(n: int): int {
+		let mut p = Pair { a: 1, b: 2 }
+		let mut i = 0
+		while (i < n) {
+			p = swap(p)
+			p.a += i
+			i += 1
+		}
+		return p.a * 1000 + p.b
+	}
+
+	fn host(n: int): int {
+		let mut i = 0
+		while (i < n) {
+			add_total(1)
+			record(i)
+			i += 1
+		}
+		return n
+	}
+
+	fn work(n: int): int {
+		return fib(n) + label(n) + pairs(n * 100) + host(n)
+	}
+)";
+
+int main() {
+	constexpr int threads = 8;
+	constexpr int calls = 20;
+	constexpr int64_t n = 18;
+
+	Environment env{};
+	env.native("add_total", reinterpret_cast<void*>(add_total), "l)l");
+	env.batch("record", add_batch, "l)v", 16);
+	auto module = compile(env, source);
+	auto code = module.function("work")->code;
+
+	VM reference;
+	auto expected = run(reference, module, "work", {n}).i64;
+	total = 0;
+	batched = 0;
+
+	std::vector<int64_t> results(threads * calls);
+	std::vector<std::thread> pool;
+	for (int t = 0; t < threads; t++) {
+		pool.emplace_back([&, t] {
+			VM vm;
+			for (int i = 0; i < calls; i++) {
+				results[t * calls + i] = run(vm, module, "work", {n}).i64;
+			}
+		});
+	}
+	for (auto& thread : pool) {
+		thread.join();
+	}
+
+	for (auto result : results) {
+		check(result == expected, "a thread got {}, expected {}", result, expected);
+	}
+	check(total == threads * calls * n, "add_total was called {} times", total.load());
+	check(batched == threads * calls * (n * (n - 1) / 2), "record got {} in all", batched.load());
+
+	auto const& after = module.function("work")->code;
+	check(std::equal(code.begin(), code.end(), after.begin(), after.end(), [](auto const& a, auto const& b) {
+		return a.handler == b.handler && a.op == b.op && a.A == b.A && a.B == b.B && a.C == b.C && a.K == b.K;
+	}), "running changed the shared code");
+	return 0;
+}